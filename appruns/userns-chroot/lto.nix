@@ -0,0 +1,76 @@
+{ runCommandCC
+, lib
+
+  # .gcda files recorded with the `instrumented` build below, see
+  # `nix run .#train-apprun`; without them, this is built with LTO only
+, profile ? null
+}:
+
+# AppRun as a static-pie built with LTO, and linked so that starting it faults
+# in and relocates as little as possible. Given a profile of AppRun starting
+# real programs, it's also built with profile-guided optimization.
+# `nix run .#bench-startup` compares it with the plain build.
+#
+# The profile is recorded on a real host rather than in the build sandbox,
+# which has no FUSE or user namespaces, so training there would mostly take
+# AppRun's error and fallback paths.
+
+let
+  # both builds have to use the same options, or the profile doesn't match
+  cflags = lib.escapeShellArgs [
+    "-O2"
+    "-flto"
+    "-static-pie"
+    # every function and object goes in a section of its own, so that the
+    # linker can drop the unused ones (and with a profile, group hot and cold
+    # code, so startup touches fewer pages)
+    "-ffunction-sections"
+    "-fdata-sections"
+    "-Wl,--gc-sections"
+    # a static-pie relocates itself before main(), and RELR packs the relative
+    # relocations into a bitmap that's a fraction of the size of .rela.dyn
+    "-Wl,-z,pack-relative-relocs"
+    # code shares its pages with read-only data, rather than being padded to
+    # its own, leaving one mapping less to fault in
+    "-Wl,-z,noseparate-code"
+  ];
+
+  # the profile is written under here, which GCOV_PREFIX moves at runtime. The
+  # build directory is left out of its name, so the final build finds it.
+  profileDir = "/nix-appimage-profile";
+
+  # pkgsStatic links everything with -static, which gcc prefers over
+  # -static-pie (picking the start files of a non-PIE executable)
+  noStatic = "unset NIX_CFLAGS_LINK";
+
+  # the paths training didn't take are optimized as usual, rather than for
+  # size, and a profile of an older main.c is ignored rather than failing the
+  # build
+  profileFlags = lib.optionalString (profile != null) (lib.escapeShellArgs [
+    "-fprofile-use=${profile}"
+    "-fprofile-partial-training"
+    "-Wno-error=coverage-mismatch"
+  ]);
+
+  instrumented = runCommandCC "AppRun-instrumented" { } ''
+    mkdir $out
+    mkdir $out/mountroot
+    ${noStatic}
+    cp ${./main.c} main.c
+    $CC ${cflags} -fprofile-generate=${profileDir} -fprofile-prefix-path="$PWD" -c main.c -o main.o
+    # see profile-exec.c
+    $CC -O2 -c ${./profile-exec.c} -o profile-exec.o
+    $CC ${cflags} -fprofile-generate=${profileDir} -Wl,--wrap=execv main.o profile-exec.o -o $out/AppRun
+  '';
+in
+runCommandCC "AppRun"
+{
+  passthru = { inherit instrumented; };
+} ''
+  mkdir $out
+  mkdir $out/mountroot
+  ${noStatic}
+  cp ${./main.c} main.c
+  $CC ${cflags} ${profileFlags} ${lib.optionalString (profile != null) ''-fprofile-prefix-path="$PWD"''} -c main.c -o main.o
+  $CC ${cflags} ${profileFlags} main.o -o $out/AppRun
+''
@@ -4,18 +4,29 @@
 #include <elf.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <libgen.h>
 #include <limits.h>
+#include <poll.h>
 #include <sched.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/mount.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 /* Exit status to use when launching an AppImage fails.
@@ -29,6 +40,7 @@
 static const char *argv0;
 static const char *appdir;
 static const char *mountroot;
+static const char *entrypoint; // link to the program to run, see select_entrypoint()
 static const size_t max_line_bytes = 1024 * 1024;
 
 static void die_if(bool cond, const char *fmt, ...) {
@@ -43,9 +55,68 @@ static void die_if(bool cond, const char *fmt, ...) {
   }
 }
 
-char *strprintf(const char *fmt, ...) {
-  va_list args1;
-  va_start(args1, fmt);
+// Allocation ------------------------------------------------------------------
+//
+// AppRun only allocates on its way to execv, so rather than pairing every
+// allocation with a free, memory comes from arenas that are released in one go
+// (or never, for launcher_arena, which lives until exec).
+
+struct arena_chunk {
+  struct arena_chunk *next;
+  size_t used;
+  size_t cap;
+  max_align_t data[];
+};
+
+struct arena {
+  struct arena_chunk *head;
+};
+
+static const size_t arena_chunk_bytes = 64 * 1024;
+static struct arena launcher_arena;
+
+static void *arena_alloc(struct arena *arena, size_t size) {
+  size = (size + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1);
+
+  struct arena_chunk *chunk = arena->head;
+  if (!chunk || chunk->cap - chunk->used < size) {
+    size_t cap = arena_chunk_bytes - sizeof(*chunk);
+    if (size > cap) {
+      cap = size;
+    }
+    chunk = malloc(sizeof(*chunk) + cap);
+    if (!chunk) {
+      fprintf(stderr, "%s: malloc %zu\n", argv0, sizeof(*chunk) + cap);
+      exit(EXIT_EXECERROR);
+    }
+    chunk->next = arena->head;
+    chunk->used = 0;
+    chunk->cap = cap;
+    arena->head = chunk;
+  }
+
+  void *ptr = (char *)chunk->data + chunk->used;
+  chunk->used += size;
+  return ptr;
+}
+
+static void arena_release(struct arena *arena) {
+  while (arena->head) {
+    struct arena_chunk *next = arena->head->next;
+    free(arena->head);
+    arena->head = next;
+  }
+}
+
+static char *arena_strndup(struct arena *arena, const char *str, size_t len) {
+  char *copy = arena_alloc(arena, len + 1);
+  memcpy(copy, str, len);
+  copy[len] = 0;
+  return copy;
+}
+
+static char *arena_vprintf(struct arena *arena, const char *fmt,
+                           va_list args1) {
   va_list args2;
   va_copy(args2, args1);
 
@@ -55,13 +126,7 @@ char *strprintf(const char *fmt, ...) {
     exit(EXIT_EXECERROR);
   }
 
-  char *buf = malloc(len + 1);
-  if (!buf) {
-    fprintf(stderr, "%s: malloc %d\n", argv0, len + 1);
-    exit(EXIT_EXECERROR);
-  }
-
-  va_end(args1);
+  char *buf = arena_alloc(arena, len + 1);
 
   if (vsnprintf(buf, len + 1, fmt, args2) != len) {
     fprintf(stderr, "%s: vsnprintf '%s' returned unexpected length\n", argv0,
@@ -74,6 +139,14 @@ char *strprintf(const char *fmt, ...) {
   return buf;
 }
 
+char *strprintf(const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  char *buf = arena_vprintf(&launcher_arena, fmt, args);
+  va_end(args);
+  return buf;
+}
+
 static int write_to(const char *path, const char *fmt, ...) {
   int fd = open(path, O_WRONLY);
   if (fd > 0) {
@@ -91,54 +164,174 @@ static int write_to(const char *path, const char *fmt, ...) {
   return 1;
 }
 
-struct string_array {
-  char **items;
-  size_t len;
-  size_t cap;
-};
+// Tracing ---------------------------------------------------------------------
+//
+// With NIX_APPIMAGE_TRACE set to a path (appended to) or a file descriptor
+// number, each startup phase is written there as a line of JSON:
+//
+//   {"source":"apprun","pid":123,"phase":"unshare","start_ns":..,"end_ns":..}
+//
+// Timestamps are CLOCK_MONOTONIC, so they can be lined up with traces from
+// other processes on the same boot. Root replication additionally gets one
+// "root-entry" line per entry of /, carrying its name and how it was handled.
+
+static int trace_fd = -1;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
 
-static void string_array_free(struct string_array *arr) {
-  if (!arr) {
+static void trace_open(void) {
+  const char *env = getenv("NIX_APPIMAGE_TRACE");
+  if (!env || env[0] == 0) {
     return;
   }
-  for (size_t i = 0; i < arr->len; i++) {
-    free(arr->items[i]);
+
+  char *end;
+  long fd = strtol(env, &end, 10);
+  if (*end == 0 && fd >= 0 && fd <= INT_MAX) {
+    trace_fd = (int)fd;
+  } else {
+    trace_fd = open(env, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  }
+  if (trace_fd < 0 || fcntl(trace_fd, F_GETFD) < 0) {
+    fprintf(stderr, "%s: cannot open trace '%s': %s\n", argv0, env,
+            strerror(errno));
+    trace_fd = -1;
   }
-  free(arr->items);
-  arr->items = NULL;
-  arr->len = 0;
-  arr->cap = 0;
 }
 
-static int string_array_push(struct string_array *arr, const char *value) {
-  if (!value) {
-    return -1;
-  }
-  if (arr->len == arr->cap) {
-    size_t new_cap = arr->cap == 0 ? 8 : arr->cap * 2;
-    char **new_items = realloc(arr->items, new_cap * sizeof(char *));
-    if (!new_items) {
-      return -1;
+// returns the start timestamp to hand to trace_end, or 0 if tracing is off
+static uint64_t trace_begin(void) { return trace_fd < 0 ? 0 : now_ns(); }
+
+// write `str` as a JSON string, not including the surrounding quotes
+static size_t json_escape(char *buf, size_t size, const char *str) {
+  size_t len = 0;
+  for (; *str && len + 7 < size; str++) {
+    unsigned char c = *str;
+    if (c == '"' || c == '\\') {
+      buf[len++] = '\\';
+      buf[len++] = c;
+    } else if (c < 0x20) {
+      len += snprintf(buf + len, size - len, "\\u%04x", c);
+    } else {
+      buf[len++] = c;
     }
-    arr->items = new_items;
-    arr->cap = new_cap;
   }
-  arr->items[arr->len] = strdup(value);
-  if (!arr->items[arr->len]) {
-    return -1;
+  buf[len] = 0;
+  return len;
+}
+
+// the extra fields in `fmt`, if any, must start with a comma
+static void trace_end(const char *phase, uint64_t start, const char *fmt,
+                      ...) {
+  if (trace_fd < 0) {
+    return;
+  }
+  uint64_t end = now_ns();
+
+  char line[PATH_MAX * 2];
+  int len = snprintf(line, sizeof(line),
+                     "{\"source\":\"apprun\",\"pid\":%d,\"phase\":\"%s\","
+                     "\"start_ns\":%llu,\"end_ns\":%llu",
+                     (int)getpid(), phase, (unsigned long long)start,
+                     (unsigned long long)end);
+  if (fmt && len > 0 && (size_t)len < sizeof(line)) {
+    va_list args;
+    va_start(args, fmt);
+    int extra = vsnprintf(line + len, sizeof(line) - len, fmt, args);
+    va_end(args);
+    len = extra < 0 ? -1 : len + extra;
+  }
+  if (len < 0 || (size_t)len + 2 >= sizeof(line)) {
+    return;
+  }
+  line[len++] = '}';
+  line[len++] = '\n';
+
+  // a single write, so lines from concurrent launches don't interleave
+  if (write(trace_fd, line, len) < 0) {
+    trace_fd = -1;
   }
-  arr->len++;
-  return 0;
 }
 
-static bool string_array_contains(const struct string_array *arr,
-                                  const char *value) {
-  for (size_t i = 0; i < arr->len; i++) {
-    if (strcmp(arr->items[i], value) == 0) {
-      return true;
+static uint64_t fnv1a_n(const char *str, size_t len) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char)str[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static uint64_t fnv1a(const char *str) { return fnv1a_n(str, strlen(str)); }
+
+// Insertion-ordered set of strings, interned into an arena. Lookups go through
+// an open-addressing (linear probing) table of indices into items.
+struct string_set {
+  struct arena *arena;
+  const char **items;
+  size_t len;
+  size_t cap;
+  uint32_t *slots; // 1 + index into items, or 0 if empty
+  size_t nslots;   // power of two, at least twice len
+};
+
+static size_t string_set_slot(const struct string_set *set, const char *value,
+                              size_t len) {
+  size_t mask = set->nslots - 1;
+  size_t slot = fnv1a_n(value, len) & mask;
+  while (set->slots[slot] != 0) {
+    const char *item = set->items[set->slots[slot] - 1];
+    if (strncmp(item, value, len) == 0 && item[len] == 0) {
+      break;
     }
+    slot = (slot + 1) & mask;
   }
-  return false;
+  return slot;
+}
+
+static bool string_set_contains_n(const struct string_set *set,
+                                  const char *value, size_t len) {
+  return set->nslots != 0 &&
+         set->slots[string_set_slot(set, value, len)] != 0;
+}
+
+// returns whether value was newly added
+static bool string_set_add_n(struct string_set *set, const char *value,
+                             size_t len) {
+  if (string_set_contains_n(set, value, len)) {
+    return false;
+  }
+
+  if (set->len == set->cap) {
+    size_t new_cap = set->cap == 0 ? 16 : set->cap * 2;
+    const char **new_items = arena_alloc(set->arena, new_cap * sizeof(char *));
+    if (set->len > 0) {
+      memcpy(new_items, set->items, set->len * sizeof(char *));
+    }
+    set->items = new_items;
+    set->cap = new_cap;
+
+    set->nslots = new_cap * 2;
+    set->slots = arena_alloc(set->arena, set->nslots * sizeof(uint32_t));
+    memset(set->slots, 0, set->nslots * sizeof(uint32_t));
+    for (size_t i = 0; i < set->len; i++) {
+      const char *item = set->items[i];
+      set->slots[string_set_slot(set, item, strlen(item))] = i + 1;
+    }
+  }
+
+  size_t slot = string_set_slot(set, value, len);
+  set->items[set->len] = arena_strndup(set->arena, value, len);
+  set->slots[slot] = ++set->len;
+  return true;
+}
+
+static bool string_set_add(struct string_set *set, const char *value) {
+  return string_set_add_n(set, value, strlen(value));
 }
 
 static char *trim_in_place(char *str) {
@@ -220,7 +413,7 @@ static bool ld_debug_enabled(void) {
   return env && env[0] != 0;
 }
 
-static char *read_elf_interp_dir(const char *path) {
+static char *read_elf_interp(const char *path) {
 	if (!path || path[0] == 0) {
 		return NULL;
 	}
@@ -283,17 +476,7 @@ static char *read_elf_interp_dir(const char *path) {
 				break;
 			}
 			interp[phdr.p_filesz] = 0;
-
-			char *dir_buf = strdup(interp);
-			free(interp);
-			if (!dir_buf) {
-				break;
-			}
-			char *dir = dirname(dir_buf);
-			if (dir) {
-				result = strdup(dir);
-			}
-			free(dir_buf);
+			result = interp;
 			break;
 		}
 	} else if (ident[EI_CLASS] == ELFCLASS64) {
@@ -332,17 +515,7 @@ static char *read_elf_interp_dir(const char *path) {
 				break;
 			}
 			interp[phdr.p_filesz] = 0;
-
-			char *dir_buf = strdup(interp);
-			free(interp);
-			if (!dir_buf) {
-				break;
-			}
-			char *dir = dirname(dir_buf);
-			if (dir) {
-				result = strdup(dir);
-			}
-			free(dir_buf);
+			result = interp;
 			break;
 		}
 	}
@@ -351,43 +524,265 @@ static char *read_elf_interp_dir(const char *path) {
 	return result;
 }
 
-static char *find_entrypoint_interp_dir(void) {
-	char *entrypoint = strprintf("%s/entrypoint", appdir);
+static char *find_entrypoint_interp(void) {
 	char exe[PATH_MAX + 1];
 	ssize_t exe_size = readlink(entrypoint, exe, PATH_MAX);
 	if (exe_size < 0) {
 		if (ld_debug_enabled()) {
 			fprintf(stderr, "%s: entrypoint readlink failed: %s\n", argv0, strerror(errno));
 		}
-		free(entrypoint);
 		return NULL;
 	}
 	exe[exe_size] = 0;
 	if (ld_debug_enabled()) {
 		fprintf(stderr, "%s: entrypoint target '%s'\n", argv0, exe);
 	}
-	free(entrypoint);
-
-	char *interp_dir = read_elf_interp_dir(exe);
-	if (!interp_dir && strncmp(exe, "/nix/", 5) == 0) {
-		char *bundled = strprintf("%s%s", appdir, exe);
-		if (bundled) {
-			interp_dir = read_elf_interp_dir(bundled);
-			free(bundled);
-		}
+
+	char *interp = read_elf_interp(exe);
+	if (!interp && strncmp(exe, "/nix/", 5) == 0) {
+		interp = read_elf_interp(strprintf("%s%s", appdir, exe));
 	}
-	if (!interp_dir && ld_debug_enabled()) {
-		fprintf(stderr, "%s: entrypoint interp dir not found\n", argv0);
+	if (!interp && ld_debug_enabled()) {
+		fprintf(stderr, "%s: entrypoint interp not found\n", argv0);
 	}
-	return interp_dir;
+	return interp;
+}
+
+// ld.so.cache parsing ---------------------------------------------------------
+//
+// Layouts mirror glibc's sysdeps/generic/dl-cache.h. The old format stores
+// string offsets relative to the end of its entry table, the new format
+// relative to the start of its header. A file may hold an old table with a new
+// one appended (glibc < 2.32 defaults to this), or just the new one.
+
+#define LD_CACHE_MAGIC_OLD "ld.so-1.7.0"
+#define LD_CACHE_MAGIC_NEW "glibc-ld.so.cache"
+#define LD_CACHE_VERSION_NEW "1.1"
+
+struct ld_cache_entry_old {
+  int32_t flags;
+  uint32_t key, value;
+};
+
+struct ld_cache_header_old {
+  char magic[sizeof LD_CACHE_MAGIC_OLD - 1];
+  uint32_t nlibs;
+};
+
+struct ld_cache_entry_new {
+  int32_t flags;
+  uint32_t key, value;
+  uint32_t osversion;
+  uint64_t hwcap;
+};
+
+struct ld_cache_header_new {
+  char magic[sizeof LD_CACHE_MAGIC_NEW - 1];
+  char version[sizeof LD_CACHE_VERSION_NEW - 1];
+  uint32_t nlibs;
+  uint32_t len_strings;
+  uint8_t flags;
+  uint8_t padding[3];
+  uint32_t extension_offset;
+  uint32_t unused[3];
+};
+
+#define LD_CACHE_ALIGN(x)                                                      \
+  (((x) + _Alignof(struct ld_cache_entry_new) - 1) &                          \
+   ~(_Alignof(struct ld_cache_entry_new) - 1))
+
+typedef int (*ld_cache_fn)(int32_t flags, const char *path, void *ctx);
+
+// returns the NUL-terminated string at base + off, or NULL if out of bounds
+static const char *ld_cache_string(const char *map, size_t size,
+                                   size_t base, uint32_t off) {
+  size_t start = base + off;
+  if (start < base || start >= size) {
+    return NULL;
+  }
+  if (!memchr(map + start, 0, size - start)) {
+    return NULL;
+  }
+  return map + start;
+}
+
+static int ld_cache_walk_new(const char *map, size_t size, size_t base,
+                             ld_cache_fn fn, void *ctx) {
+  if (size - base < sizeof(struct ld_cache_header_new)) {
+    return -1;
+  }
+  const struct ld_cache_header_new *hdr = (const void *)(map + base);
+  if (memcmp(hdr->magic, LD_CACHE_MAGIC_NEW, sizeof hdr->magic) != 0 ||
+      memcmp(hdr->version, LD_CACHE_VERSION_NEW, sizeof hdr->version) != 0) {
+    return -1;
+  }
+
+  // flags: 0 means unknown endianness, 2 little, 3 big
+  uint8_t native = __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ ? 2 : 3;
+  if (hdr->flags != 0 && hdr->flags != native) {
+    return -1;
+  }
+
+  size_t table = base + sizeof(*hdr);
+  if ((size - table) / sizeof(struct ld_cache_entry_new) < hdr->nlibs) {
+    return -1;
+  }
+
+  for (uint32_t i = 0; i < hdr->nlibs; i++) {
+    struct ld_cache_entry_new entry;
+    memcpy(&entry, map + table + i * sizeof(entry), sizeof(entry));
+    const char *path = ld_cache_string(map, size, base, entry.value);
+    if (path && fn(entry.flags, path, ctx) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int ld_cache_walk(const char *map, size_t size, ld_cache_fn fn,
+                         void *ctx) {
+  if (size >= sizeof(struct ld_cache_header_old) &&
+      memcmp(map, LD_CACHE_MAGIC_OLD, sizeof LD_CACHE_MAGIC_OLD - 1) == 0) {
+    const struct ld_cache_header_old *hdr = (const void *)map;
+    size_t table = sizeof(*hdr);
+    if ((size - table) / sizeof(struct ld_cache_entry_old) < hdr->nlibs) {
+      return -1;
+    }
+    size_t strings = table + hdr->nlibs * sizeof(struct ld_cache_entry_old);
+
+    // prefer an appended new-format table, since it's what ld.so reads too
+    size_t appended = LD_CACHE_ALIGN(strings);
+    if (appended < size &&
+        ld_cache_walk_new(map, size, appended, fn, ctx) == 0) {
+      return 0;
+    }
+
+    for (uint32_t i = 0; i < hdr->nlibs; i++) {
+      struct ld_cache_entry_old entry;
+      memcpy(&entry, map + table + i * sizeof(entry), sizeof(entry));
+      const char *path = ld_cache_string(map, size, strings, entry.value);
+      if (path && fn(entry.flags, path, ctx) != 0) {
+        return -1;
+      }
+    }
+    return 0;
+  }
+
+  return ld_cache_walk_new(map, size, 0, fn, ctx);
 }
 
-static int collect_ldconfig_dirs(struct string_array *collected) {
-  struct elf_id self_id = {0};
-  if (read_elf_id("/proc/self/exe", &self_id) != 0) {
+static int ld_cache_foreach(const char *cache_path, ld_cache_fn fn,
+                            void *ctx) {
+  int fd = open(cache_path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+
+  struct stat statbuf;
+  if (fstat(fd, &statbuf) < 0 || statbuf.st_size <= 0) {
+    close(fd);
+    return -1;
+  }
+
+  size_t size = (size_t)statbuf.st_size;
+  void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
     return -1;
   }
 
+  int ret = ld_cache_walk(map, size, fn, ctx);
+  munmap(map, size);
+  return ret;
+}
+
+// Host library directories -------------------------------------------------
+
+// Probing a library means opening and reading it, and a typical host has
+// thousands in its cache but only a handful of directories. So only libraries
+// from directories we haven't accepted yet are probed, and a directory that
+// failed the check is skipped for every other library with the same cache
+// flags (which encode the ABI, e.g. libc6,x86-64 vs libc6).
+//
+// With patterns (see LD_LIBRARY_PATH below), the libraries whose file names
+// match one are collected instead of directories, the first one of each name
+// that has our ABI.
+struct ldconfig_ctx {
+  struct string_set *collected;
+  struct string_set rejected; // "<flags> <dir>"
+  struct elf_id self_id;
+  const struct string_set *patterns;
+  struct string_set names; // of the collected libraries, with patterns
+};
+
+static bool host_lib_wanted(struct ldconfig_ctx *ctx, const char *name) {
+  if (string_set_contains_n(&ctx->names, name, strlen(name))) {
+    return false;
+  }
+  for (size_t i = 0; i < ctx->patterns->len; i++) {
+    if (fnmatch(ctx->patterns->items[i], name, 0) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static int add_ldconfig_lib(struct ldconfig_ctx *ctx, int32_t flags,
+                            const char *path) {
+  const char *slash = strrchr(path, '/');
+  if (!slash || slash == path || (size_t)(slash - path) >= PATH_MAX) {
+    return 0;
+  }
+  size_t dir_len = slash - path;
+  if (ctx->patterns ? !host_lib_wanted(ctx, slash + 1)
+                    : string_set_contains_n(ctx->collected, path, dir_len)) {
+    return 0;
+  }
+
+  char memo[PATH_MAX + 16];
+  int memo_len = snprintf(memo, sizeof(memo), "%x %.*s", (unsigned)flags,
+                          (int)dir_len, path);
+  if (string_set_contains_n(&ctx->rejected, memo, memo_len)) {
+    return 0;
+  }
+
+  struct elf_id lib_id = {0};
+  if (read_elf_id(path, &lib_id) != 0) {
+    if (ld_debug_enabled()) {
+      fprintf(stderr, "%s: ldconfig skip non-ELF '%s'\n", argv0, path);
+    }
+    // a broken library doesn't say anything about the rest of the directory
+    return 0;
+  }
+  if (lib_id.elf_class != ctx->self_id.elf_class ||
+      lib_id.machine != ctx->self_id.machine) {
+    string_set_add_n(&ctx->rejected, memo, memo_len);
+    return 0;
+  }
+
+  if (ctx->patterns) {
+    string_set_add(&ctx->names, slash + 1);
+    string_set_add(ctx->collected, path);
+    if (ld_debug_enabled()) {
+      fprintf(stderr, "%s: ldconfig add lib '%s'\n", argv0, path);
+    }
+    return 0;
+  }
+
+  string_set_add_n(ctx->collected, path, dir_len);
+  if (ld_debug_enabled()) {
+    fprintf(stderr, "%s: ldconfig add dir '%.*s'\n", argv0, (int)dir_len,
+            path);
+  }
+  return 0;
+}
+
+static int add_ld_cache_entry(int32_t flags, const char *path, void *ctx) {
+  return add_ldconfig_lib(ctx, flags, path);
+}
+
+// fallback for hosts whose cache we can't parse: ask ldconfig itself
+static int collect_ldconfig_popen(struct ldconfig_ctx *ctx) {
   const char *cmds[] = {
       "LC_ALL=C ldconfig -p",
       "LC_ALL=C /sbin/ldconfig -p",
@@ -426,37 +821,20 @@ static int collect_ldconfig_dirs(struct string_array *collected) {
       continue;
     }
 
-    struct elf_id lib_id = {0};
-    if (read_elf_id(path, &lib_id) != 0) {
-      if (ld_debug_enabled()) {
-        fprintf(stderr, "%s: ldconfig skip non-ELF '%s'\n", argv0, path);
-      }
-      continue;
-    }
-    if (lib_id.elf_class != self_id.elf_class ||
-        lib_id.machine != self_id.machine) {
-      continue;
+    // lines look like "libfoo.so.1 (libc6,x86-64) => /path", so use the
+    // parenthesised ABI description in place of the cache flags
+    int32_t flags = 0;
+    *arrow = 0;
+    char *open_paren = strrchr(line, '(');
+    if (open_paren) {
+      flags = (int32_t)fnv1a(open_paren);
     }
 
-    char *dir_buf = strdup(path);
-    if (!dir_buf) {
+    if (add_ldconfig_lib(ctx, flags, path) != 0) {
       free(line);
       pclose(pipe);
       return -1;
     }
-    char *dir = dirname(dir_buf);
-    if (dir && !string_array_contains(collected, dir)) {
-      if (string_array_push(collected, dir) != 0) {
-        free(dir_buf);
-        free(line);
-        pclose(pipe);
-        return -1;
-      }
-      if (ld_debug_enabled()) {
-        fprintf(stderr, "%s: ldconfig add dir '%s'\n", argv0, dir);
-      }
-    }
-    free(dir_buf);
   }
 
   free(line);
@@ -464,113 +842,1672 @@ static int collect_ldconfig_dirs(struct string_array *collected) {
   return 0;
 }
 
-static void extend_ld_library_path(void) {
-	struct string_array parsed = {0};
-	struct string_array entries = {0};
-	char *interp_dir = find_entrypoint_interp_dir();
-	if (interp_dir) {
-		if (string_array_push(&entries, interp_dir) != 0) {
-			free(interp_dir);
-			goto cleanup;
-		}
-		if (ld_debug_enabled()) {
-			fprintf(stderr, "%s: entrypoint interp dir '%s'\n", argv0, interp_dir);
-		}
-		free(interp_dir);
-	}
-	if (collect_ldconfig_dirs(&parsed) != 0) {
-		string_array_free(&parsed);
-		return;
-	}
-  const char *env_ld = getenv("LD_LIBRARY_PATH");
-  if (env_ld && env_ld[0] != 0) {
-    const char *cursor = env_ld;
-    while (true) {
-      const char *colon = strchr(cursor, ':');
-      size_t len = colon ? (size_t)(colon - cursor) : strlen(cursor);
-      if (len > 0) {
-        char *segment = strndup(cursor, len);
-        if (!segment || string_array_push(&entries, segment) != 0) {
-          free(segment);
-          goto cleanup;
-        }
-        free(segment);
-      }
-      if (!colon) {
-        break;
-      }
-      cursor = colon + 1;
-    }
+// Persistent cache of the collected directories ---------------------------
+//
+// Scanning the host libraries is by far the slowest part of extending
+// LD_LIBRARY_PATH, but its result only changes when ld.so.cache does. We keep
+// it in $XDG_CACHE_HOME/nix-appimage/ldpath-<hash>, where the hash covers the
+// entrypoint (i.e. the image) and the host library patterns, and the first line
+// records the identity of the ld.so.cache it was computed from.
+
+#define LDPATH_CACHE_MAGIC "nix-appimage-ldpath 1"
+
+static char *cache_dir(void) {
+  const char *xdg = getenv("XDG_CACHE_HOME");
+  if (xdg && xdg[0] == '/') {
+    return strprintf("%s/nix-appimage", xdg);
+  }
+  const char *home = getenv("HOME");
+  if (home && home[0] == '/') {
+    return strprintf("%s/.cache/nix-appimage", home);
   }
+  return NULL;
+}
 
-  for (size_t i = 0; i < parsed.len; i++) {
-    if (string_array_contains(&entries, parsed.items[i])) {
-      continue;
+static char *ldpath_cache_path(const struct string_set *patterns) {
+  char exe[PATH_MAX + 1];
+  ssize_t exe_size = readlink(entrypoint, exe, PATH_MAX);
+  if (exe_size < 0) {
+    return NULL;
+  }
+  exe[exe_size] = 0;
+
+  char *dir = cache_dir();
+  if (!dir) {
+    return NULL;
+  }
+  if (!patterns) {
+    return strprintf("%s/ldpath-%016llx", dir, (unsigned long long)fnv1a(exe));
+  }
+  uint64_t hash = fnv1a(exe);
+  for (size_t i = 0; i < patterns->len; i++) {
+    hash = hash * 31 + fnv1a(patterns->items[i]);
+  }
+  return strprintf("%s/hostlibs-%016llx", dir, (unsigned long long)hash);
+}
+
+static char *ldpath_cache_key(const struct stat *ld_cache) {
+  return strprintf("%llu %llu %lld %lld %ld",
+                   (unsigned long long)ld_cache->st_dev,
+                   (unsigned long long)ld_cache->st_ino,
+                   (long long)ld_cache->st_size,
+                   (long long)ld_cache->st_mtim.tv_sec,
+                   (long)ld_cache->st_mtim.tv_nsec);
+}
+
+static int load_ldpath_cache(const char *path, const char *key,
+                             struct string_set *collected) {
+  FILE *file = fopen(path, "re");
+  if (!file) {
+    return -1;
+  }
+
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t linelen;
+  int lineno = 0;
+  int ret = 0;
+  while ((linelen = getline(&line, &linecap, file)) != -1) {
+    if (linelen > 0 && line[linelen - 1] == '\n') {
+      line[--linelen] = 0;
     }
-    if (string_array_push(&entries, parsed.items[i]) != 0) {
-      goto cleanup;
+    lineno++;
+
+    if ((lineno == 1 && strcmp(line, LDPATH_CACHE_MAGIC) != 0) ||
+        (lineno == 2 && strcmp(line, key) != 0)) {
+      ret = -1;
+      break;
+    }
+    if (lineno <= 2 || line[0] == 0) {
+      continue;
     }
+    string_set_add_n(collected, line, linelen);
   }
 
-  size_t total = 0;
-  for (size_t i = 0; i < entries.len; i++) {
-    total += strlen(entries.items[i]);
-    if (i + 1 < entries.len) {
-      total++;
+  free(line);
+  fclose(file);
+  if (lineno < 2) {
+    ret = -1;
+  }
+  if (ret != 0) {
+    *collected = (struct string_set){.arena = collected->arena};
+  }
+  return ret;
+}
+
+static void store_ldpath_cache(const char *path, const char *key,
+                               const struct string_set *collected) {
+  // create the cache dir (and $XDG_CACHE_HOME itself) if needed
+  char *dir = dirname(strprintf("%s", path));
+  mkdir(dirname(strprintf("%s", dir)), 0700);
+  mkdir(dir, 0700);
+
+  // write to a temporary file and rename, so concurrent launches never see a
+  // partial cache
+  char *tmp = strprintf("%s.%d.tmp", path, (int)getpid());
+  FILE *file = fopen(tmp, "we");
+  if (!file) {
+    if (ld_debug_enabled()) {
+      fprintf(stderr, "%s: cannot write ldpath cache '%s': %s\n", argv0, tmp,
+              strerror(errno));
     }
+    return;
   }
 
-  if (total == 0) {
-    goto cleanup;
+  bool ok = fprintf(file, "%s\n%s\n", LDPATH_CACHE_MAGIC, key) >= 0;
+  for (size_t i = 0; ok && i < collected->len; i++) {
+    ok = fprintf(file, "%s\n", collected->items[i]) >= 0;
+  }
+  if (fclose(file) != 0) {
+    ok = false;
   }
 
-  char *combined = malloc(total + 1);
-  if (!combined) {
-    goto cleanup;
+  if (!ok || rename(tmp, path) < 0) {
+    unlink(tmp);
+  } else if (ld_debug_enabled()) {
+    fprintf(stderr, "%s: stored ldpath cache '%s'\n", argv0, path);
   }
+}
 
-  size_t offset = 0;
-  for (size_t i = 0; i < entries.len; i++) {
-    size_t len = strlen(entries.items[i]);
-    memcpy(combined + offset, entries.items[i], len);
-    offset += len;
-    if (i + 1 < entries.len) {
-      combined[offset++] = ':';
+// collects library directories, or with patterns, the matching libraries
+static int collect_ldconfig_dirs(struct string_set *collected,
+                                 const struct string_set *patterns) {
+  struct stat ld_cache;
+  bool have_ld_cache = stat("/etc/ld.so.cache", &ld_cache) == 0;
+
+  char *cache_path = NULL;
+  char *cache_key = NULL;
+  if (have_ld_cache) {
+    cache_path = ldpath_cache_path(patterns);
+    cache_key = ldpath_cache_key(&ld_cache);
+    if (cache_path &&
+        load_ldpath_cache(cache_path, cache_key, collected) == 0) {
+      if (ld_debug_enabled()) {
+        fprintf(stderr, "%s: using ldpath cache '%s'\n", argv0, cache_path);
+      }
+      return 0;
     }
   }
-  combined[offset] = 0;
 
-  if (setenv("LD_LIBRARY_PATH", combined, 1) < 0) {
-    fprintf(stderr, "%s: unable to set LD_LIBRARY_PATH: %s\n", argv0,
-            strerror(errno));
-  } else if (ld_debug_enabled()) {
-    fprintf(stderr, "%s: LD_LIBRARY_PATH='%s'\n", argv0, combined);
+  struct ldconfig_ctx ctx = {
+      .collected = collected,
+      .rejected = {.arena = collected->arena},
+      .patterns = patterns,
+      .names = {.arena = collected->arena},
+  };
+  if (read_elf_id("/proc/self/exe", &ctx.self_id) != 0) {
+    return -1;
   }
 
-  free(combined);
+  if (have_ld_cache &&
+      ld_cache_foreach("/etc/ld.so.cache", add_ld_cache_entry, &ctx) == 0) {
+    if (cache_path) {
+      store_ldpath_cache(cache_path, cache_key, collected);
+    }
+    return 0;
+  }
+  if (ld_debug_enabled()) {
+    fprintf(stderr, "%s: cannot parse /etc/ld.so.cache, running ldconfig\n",
+            argv0);
+  }
 
-cleanup:
-  string_array_free(&entries);
-  string_array_free(&parsed);
+  // discard anything a partially-parsed cache added
+  *collected = (struct string_set){.arena = collected->arena};
+  ctx.rejected = (struct string_set){.arena = collected->arena};
+  ctx.names = (struct string_set){.arena = collected->arena};
+  return collect_ldconfig_popen(&ctx);
 }
 
-void child_main(char **argv) {
-  // get uid, gid before going to new namespace
-  uid_t uid = getuid();
-  gid_t gid = getgid();
+// LD_LIBRARY_PATH -------------------------------------------------------------
+//
+// Putting every host library directory on LD_LIBRARY_PATH makes each dlopen(),
+// and each library of every program the app runs, probe all of them, which
+// mostly misses. So an image built with mkAppImage's `hostLibs` lists the file
+// names (as globs) of the libraries it may need from the host, e.g. GPU
+// drivers, in <appdir>/host-libs. We symlink those into a single directory in
+// the new root, and only that goes on LD_LIBRARY_PATH. Without a new root (the
+// host store and nix-only modes), the directories they are in are used, which
+// are still only a few. The result is only exported if it has to be, see
+// exec_entrypoint().
+
+#define HOST_LIBS_DIR "/.nix-appimage-host-libs"
+
+// the host libraries to link into HOST_LIBS_DIR, and what goes before it on
+// LD_LIBRARY_PATH (or NULL), both set by extend_ld_library_path()
+static struct string_set host_libs = {.arena = &launcher_arena};
+static const char *ld_path_prefix;
+
+// what collect_ldconfig_dirs() found, ':'-separated, which the zygote hands
+// to its clients so they don't have to look again
+static const char *host_lib_paths = "";
+
+// the library path for the entrypoint (or NULL), and its ld.so (or NULL)
+static const char *ld_library_path;
+static const char *entrypoint_interp;
+
+// whether to start the entrypoint through entrypoint_interp, see
+// exec_through_interp()
+static bool exec_through_ld;
+
+static bool exec_through_ld_requested(void) {
+  const char *env = getenv("NIX_APPIMAGE_EXEC_THROUGH_LD");
+  return env && strcmp(env, "1") == 0;
+}
+
+// --argv0 is glibc 2.33+, older ones would take it for the program to run.
+// mkAppImage lists the entrypoints' ld.so that are new enough in
+// <appdir>/interp-argv0.
+static bool interp_takes_argv0(const char *interp) {
+  FILE *file = fopen(strprintf("%s/interp-argv0", appdir), "re");
+  if (!file) {
+    return false;
+  }
+
+  bool found = false;
+  char *line = NULL;
+  size_t linecap = 0;
+  while (!found && getline(&line, &linecap, file) != -1) {
+    found = strcmp(trim_in_place(line), interp) == 0;
+  }
+  free(line);
+  fclose(file);
+  return found;
+}
+
+static bool read_host_lib_patterns(struct string_set *patterns) {
+  FILE *file = fopen(strprintf("%s/host-libs", appdir), "re");
+  if (!file) {
+    return false;
+  }
+
+  char *line = NULL;
+  size_t linecap = 0;
+  while (getline(&line, &linecap, file) != -1) {
+    char *pattern = trim_in_place(line);
+    if (pattern[0] != 0 && pattern[0] != '#') {
+      string_set_add(patterns, pattern);
+    }
+  }
+  free(line);
+  fclose(file);
+  return true;
+}
+
+static char *join_paths(struct arena *arena, const struct string_set *paths) {
+  size_t total = 0;
+  for (size_t i = 0; i < paths->len; i++) {
+    total += strlen(paths->items[i]);
+    if (i + 1 < paths->len) {
+      total++;
+    }
+  }
+
+  char *combined = arena_alloc(arena, total + 1);
+  size_t offset = 0;
+  for (size_t i = 0; i < paths->len; i++) {
+    size_t len = strlen(paths->items[i]);
+    memcpy(combined + offset, paths->items[i], len);
+    offset += len;
+    if (i + 1 < paths->len) {
+      combined[offset++] = ':';
+    }
+  }
+  combined[offset] = 0;
+  return combined;
+}
+
+// add the entries of a ':'-separated list to `set`
+static void add_path_list(struct string_set *set, const char *list) {
+  const char *cursor = list;
+  while (true) {
+    const char *colon = strchr(cursor, ':');
+    size_t len = colon ? (size_t)(colon - cursor) : strlen(cursor);
+    if (len > 0) {
+      string_set_add_n(set, cursor, len);
+    }
+    if (!colon) {
+      break;
+    }
+    cursor = colon + 1;
+  }
+}
+
+static void set_ld_library_path(const char *value) {
+  ld_library_path = value;
+  if (ld_debug_enabled()) {
+    fprintf(stderr, "%s: library path '%s'\n", argv0, value);
+  }
+}
+
+// `found` is what collect_ldconfig_dirs() found in an earlier run, if not NULL
+static void extend_ld_library_path(const char *found) {
+  // everything but the result is only needed here, so it all goes in one arena
+  struct arena scratch = {0};
+  struct string_set parsed = {.arena = &scratch};
+  struct string_set entries = {.arena = &scratch};
+  struct string_set patterns = {.arena = &scratch};
+  bool have_patterns = read_host_lib_patterns(&patterns);
+
+  uint64_t start = trace_begin();
+  char *interp = find_entrypoint_interp();
+  trace_end("interp", start, NULL);
+  const char *slash = interp ? strrchr(interp, '/') : NULL;
+  if (slash && slash > interp) {
+    entrypoint_interp = arena_strndup(&launcher_arena, interp, strlen(interp));
+    exec_through_ld =
+        exec_through_ld_requested() && interp_takes_argv0(entrypoint_interp);
+    string_set_add_n(&entries, interp, slash - interp);
+    if (ld_debug_enabled()) {
+      fprintf(stderr, "%s: entrypoint interp '%s'\n", argv0, interp);
+    }
+  }
+  free(interp);
+  if (found) {
+    add_path_list(&parsed, found);
+  } else {
+    start = trace_begin();
+    int collected =
+        collect_ldconfig_dirs(&parsed, have_patterns ? &patterns : NULL);
+    trace_end("ldconfig", start, ",\"%s\":%zu",
+              have_patterns ? "libs" : "dirs", parsed.len);
+    if (collected != 0) {
+      arena_release(&scratch);
+      return;
+    }
+  }
+  host_lib_paths = join_paths(&launcher_arena, &parsed);
+
+  const char *env_ld = getenv("LD_LIBRARY_PATH");
+  if (env_ld && env_ld[0] != 0) {
+    add_path_list(&entries, env_ld);
+  }
+
+  if (have_patterns) {
+    // link_host_libs() replaces the directories added below with HOST_LIBS_DIR
+    if (entries.len > 0) {
+      ld_path_prefix = join_paths(&launcher_arena, &entries);
+    }
+    for (size_t i = 0; i < parsed.len; i++) {
+      const char *path = parsed.items[i];
+      string_set_add(&host_libs, path);
+      string_set_add_n(&entries, path, strrchr(path, '/') - path);
+    }
+  } else {
+    for (size_t i = 0; i < parsed.len; i++) {
+      string_set_add(&entries, parsed.items[i]);
+    }
+  }
+
+  if (entries.len > 0) {
+    set_ld_library_path(join_paths(&launcher_arena, &entries));
+  }
+
+  arena_release(&scratch);
+}
+
+static void use_host_libs_dir(void) {
+  set_ld_library_path(ld_path_prefix
+                          ? strprintf("%s:%s", ld_path_prefix, HOST_LIBS_DIR)
+                          : HOST_LIBS_DIR);
+}
+
+// called with the new root set up, under mountroot
+static void link_host_libs(void) {
+  char *dir = strprintf("%s%s", mountroot, HOST_LIBS_DIR);
+  die_if(mkdir(dir, 0755) < 0, "mkdir %s", dir);
+  for (size_t i = 0; i < host_libs.len; i++) {
+    const char *path = host_libs.items[i];
+    char *link = strprintf("%s%s", dir, strrchr(path, '/'));
+    die_if(symlink(path, link) < 0, "symlink %s -> %s", link, path);
+  }
+
+  use_host_libs_dir();
+}
+
+// Mounting --------------------------------------------------------------------
+//
+// On kernels >= 5.2 we use the new mount API (open_tree/move_mount/fsmount),
+// which clones a recursive bind as a single detached tree instead of walking
+// it mount by mount, and can set propagation on a mount before it's attached.
+// mount(2) remains the fallback for older kernels. Constants are defined here
+// since neither older glibc nor musl expose them.
+
+#ifndef SYS_open_tree
+#define SYS_open_tree 428
+#endif
+#ifndef SYS_move_mount
+#define SYS_move_mount 429
+#endif
+#ifndef SYS_fsopen
+#define SYS_fsopen 430
+#endif
+#ifndef SYS_fsconfig
+#define SYS_fsconfig 431
+#endif
+#ifndef SYS_fsmount
+#define SYS_fsmount 432
+#endif
+#ifndef SYS_mount_setattr
+#define SYS_mount_setattr 442
+#endif
+
+#ifndef OPEN_TREE_CLONE
+#define OPEN_TREE_CLONE 1
+#endif
+#ifndef OPEN_TREE_CLOEXEC
+#define OPEN_TREE_CLOEXEC O_CLOEXEC
+#endif
+#ifndef AT_RECURSIVE
+#define AT_RECURSIVE 0x8000
+#endif
+#ifndef MOVE_MOUNT_F_EMPTY_PATH
+#define MOVE_MOUNT_F_EMPTY_PATH 0x00000004
+#endif
+#ifndef FSOPEN_CLOEXEC
+#define FSOPEN_CLOEXEC 0x00000001
+#endif
+#ifndef FSCONFIG_CMD_CREATE
+#define FSCONFIG_CMD_CREATE 6
+#endif
+#ifndef FSMOUNT_CLOEXEC
+#define FSMOUNT_CLOEXEC 0x00000001
+#endif
+#ifndef AT_NO_AUTOMOUNT
+#define AT_NO_AUTOMOUNT 0x800
+#endif
+#ifndef AT_STATX_DONT_SYNC
+#define AT_STATX_DONT_SYNC 0x4000
+#endif
+#ifndef STATX_TYPE
+#define STATX_TYPE 0x00000001
+#endif
+
+struct mount_attr_v0 {
+  uint64_t attr_set;
+  uint64_t attr_clr;
+  uint64_t propagation;
+  uint64_t userns_fd;
+};
+
+// the start of struct statx, padded to its full size
+struct statx_v0 {
+  uint32_t stx_mask;
+  uint32_t stx_blksize;
+  uint64_t stx_attributes;
+  uint32_t stx_nlink;
+  uint32_t stx_uid;
+  uint32_t stx_gid;
+  uint16_t stx_mode;
+  uint16_t spare;
+  uint64_t rest[28];
+};
+
+// set once mount_tmpfs() finds out whether the new API works, which is
+// whether fsopen() does (open_tree() came with it)
+static bool have_mount_api;
+
+static int fsmount_tmpfs(const char *to) {
+  int fs = syscall(SYS_fsopen, "tmpfs", FSOPEN_CLOEXEC);
+  if (fs < 0) {
+    return -1;
+  }
+  have_mount_api = true;
+  if (syscall(SYS_fsconfig, fs, FSCONFIG_CMD_CREATE, NULL, NULL, 0) < 0) {
+    close(fs);
+    return -1;
+  }
+  int mnt = syscall(SYS_fsmount, fs, FSMOUNT_CLOEXEC, 0);
+  close(fs);
+  if (mnt < 0) {
+    return -1;
+  }
+
+  // make unbindable before anything can see it. mount_setattr() is 5.12+,
+  // older kernels get it done once it's attached, as with mount(2).
+  struct mount_attr_v0 attr = {.propagation = MS_UNBINDABLE};
+  bool unbindable = syscall(SYS_mount_setattr, mnt, "", AT_EMPTY_PATH, &attr,
+                            sizeof(attr)) == 0;
+  if (syscall(SYS_move_mount, mnt, "", AT_FDCWD, to,
+              MOVE_MOUNT_F_EMPTY_PATH) < 0) {
+    close(mnt);
+    return -1;
+  }
+  close(mnt);
+  die_if(!unbindable && mount(to, to, NULL, MS_UNBINDABLE, NULL) < 0,
+         "mount tmpfs bind -> %s", to);
+  return 0;
+}
+
+// mount an unbindable tmpfs at `to`
+static void mount_tmpfs(const char *to) {
+  if (fsmount_tmpfs(to) == 0) {
+    return;
+  }
+
+  // tmpfs so we don't need to cleanup
+  die_if(mount("tmpfs", to, "tmpfs", 0, 0) < 0, "mount tmpfs -> %s", to);
+  // make unbindable to both prevent event propagation as well as mount
+  // explosion
+  die_if(mount(to, to, "none", MS_UNBINDABLE, 0) < 0, "mount tmpfs bind -> %s",
+         to);
+}
+
+// attach a tree from open_tree() at `to`, closing it
+static int attach_tree(int tree, const char *to) {
+  int ret =
+      syscall(SYS_move_mount, tree, "", AT_FDCWD, to, MOVE_MOUNT_F_EMPTY_PATH);
+  int saved_errno = errno;
+  close(tree);
+  errno = saved_errno;
+  return ret < 0 ? -1 : 0;
+}
+
+// recursively bind-mount `from` onto `to`, which must already exist
+static int bind_mount(const char *from, const char *to) {
+  if (have_mount_api) {
+    int tree = syscall(SYS_open_tree, AT_FDCWD, from,
+                       OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC | AT_RECURSIVE);
+    if (tree >= 0) {
+      return attach_tree(tree, to);
+    }
+  }
+  return mount(from, to, "none", MS_BIND | MS_REC, 0);
+}
+
+// The same for <fromfd>/<name>, whose path is `from`. If it's an automount
+// point that isn't mounted, it's bound as it is, rather than waiting for the
+// automount (with an NFS server that may be down) first. mount(2) can't do
+// that, so old kernels still trigger it.
+static int bind_mount_at(int fromfd, const char *name, const char *from,
+                         const char *to) {
+  if (have_mount_api) {
+    int tree = syscall(SYS_open_tree, fromfd, name,
+                       OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC | AT_RECURSIVE |
+                           AT_NO_AUTOMOUNT | AT_SYMLINK_NOFOLLOW);
+    if (tree >= 0) {
+      return attach_tree(tree, to);
+    }
+  }
+  return mount(from, to, "none", MS_BIND | MS_REC, 0);
+}
+
+// The file type (the S_IFMT bits) of <fromfd>/<entry>, or 0 on failure. Most
+// filesystems put it in the directory entry, so no stat is needed. Otherwise
+// statx() can be told not to trigger automounts, nor to ask a network
+// filesystem's server for attributes it has cached, which can block for as
+// long as the server is unreachable.
+static mode_t entry_type(int fromfd, const struct dirent *entry) {
+  if (entry->d_type != DT_UNKNOWN) {
+    return DTTOIF(entry->d_type);
+  }
+#ifdef SYS_statx
+  struct statx_v0 stx;
+  if (syscall(SYS_statx, fromfd, entry->d_name,
+              AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT | AT_STATX_DONT_SYNC,
+              STATX_TYPE, &stx) == 0) {
+    return stx.stx_mode & S_IFMT;
+  }
+  if (errno != ENOSYS) {
+    return 0;
+  }
+#endif
+  struct stat statbuf;
+  if (fstatat(fromfd, entry->d_name, &statbuf,
+              AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT) < 0) {
+    return 0;
+  }
+  return statbuf.st_mode & S_IFMT;
+}
+
+// Make <from_dir>/<entry> visible as <to_dir>/<entry>, <from_dir> being open
+// as `fromfd`. Directories and files are bind mounted, while symlinks (e.g.
+// merged-/usr's /bin -> usr/bin) are recreated as symlinks, which resolve the
+// same way inside the chroot but cost no mount. Nothing here looks inside the
+// entry, so a hung mount under / doesn't hang us too.
+//
+// We don't treat failure here as an actual failure, since our logic is not
+// robust enough to handle weird filesystem scenarios.
+static const char *replicate_entry(int fromfd, const char *from_dir,
+                                   const char *to_dir,
+                                   const struct dirent *entry) {
+  const char *name = entry->d_name;
+  char *from = strprintf("%s/%s", from_dir, name);
+  char *to = strprintf("%s/%s", to_dir, name);
+
+  mode_t type = entry_type(fromfd, entry);
+  if (type == 0) {
+    fprintf(stderr, "%s: stat %s: %s\n", argv0, from, strerror(errno));
+    return "failed";
+  }
+
+  if (S_ISLNK(type)) {
+    char target[PATH_MAX + 1];
+    ssize_t target_size = readlinkat(fromfd, name, target, PATH_MAX);
+    if (target_size < 0) {
+      fprintf(stderr, "%s: readlink %s: %s\n", argv0, from, strerror(errno));
+      return "failed";
+    }
+    target[target_size] = 0;
+    if (symlink(target, to) < 0) {
+      fprintf(stderr, "%s: symlink %s -> %s: %s\n", argv0, to, target,
+              strerror(errno));
+      return "failed";
+    }
+    return "symlink";
+  }
+
+  // the mount hides the mount point's own permissions, so any will do
+  if (S_ISDIR(type)) {
+    die_if(mkdir(to, 0755) < 0, "mkdir %s", to);
+  } else {
+    // effectively touch
+    int fd = creat(to, 0644);
+    if (fd == -1) {
+      fprintf(stderr, "%s: creat %s: %s\n", argv0, to, strerror(errno));
+      return "failed";
+    }
+    close(fd);
+  }
+
+  if (bind_mount_at(fromfd, name, from, to) < 0) {
+    fprintf(stderr, "%s: mount %s -> %s: %s\n", argv0, from, to,
+            strerror(errno));
+    return "failed";
+  }
+  return "bind";
+}
+
+// Make /<name> visible as <mountroot>/<name>
+static const char *replicate_root_entry(int rootfd,
+                                        const struct dirent *entry) {
+  return replicate_entry(rootfd, "", mountroot, entry);
+}
+
+// Host store ------------------------------------------------------------------
+//
+// With NIX_APPIMAGE_HOST_STORE=1, if every store path in the image's closure
+// (listed one per line in <appdir>/closure by mkAppImage) already exists in
+// the host's /nix/store, the entrypoint is run straight from there. That
+// skips the namespace setup entirely, and shares the page cache with anything
+// else on the host using the same paths.
+
+static bool host_store_enabled(void) {
+  const char *env = getenv("NIX_APPIMAGE_HOST_STORE");
+  return env && strcmp(env, "1") == 0;
+}
+
+static bool closure_on_host(void) {
+  char *path = strprintf("%s/closure", appdir);
+  FILE *file = fopen(path, "re");
+  if (!file) {
+    // images from before the closure was embedded
+    return false;
+  }
+
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t linelen;
+  size_t checked = 0;
+  bool present = true;
+  while (present && (linelen = getline(&line, &linecap, file)) != -1) {
+    if (linelen > 0 && line[linelen - 1] == '\n') {
+      line[--linelen] = 0;
+    }
+    if (line[0] == 0) {
+      continue;
+    }
+    present = strncmp(line, "/nix/store/", 11) == 0 && access(line, F_OK) == 0;
+    if (!present && ld_debug_enabled()) {
+      fprintf(stderr, "%s: '%s' not in host store\n", argv0, line);
+    }
+    checked++;
+  }
+
+  free(line);
+  fclose(file);
+  return present && checked > 0;
+}
+
+// Layers ----------------------------------------------------------------------
+//
+// An image built with mkAppImage's `base` leaves out the store paths that are
+// in its base layer, and names the layer in <appdir>/base. The layer is an
+// AppImage of its own (without an AppRun) that any number of images can share.
+// We look for it in $NIX_APPIMAGE_LAYERS_PATH, next to the image, and in
+// $XDG_DATA_HOME/nix-appimage/layers, mount it with its runtime's
+// --appimage-mount, and merge its store with the image's.
+//
+// This has to happen before unshare(), since fusermount can't mount anything
+// from inside a user namespace.
+
+// the base layer's store once it's mounted, or NULL if the image has no base
+static char *base_store;
+
+static char *read_base_name(void) {
+  FILE *file = fopen(strprintf("%s/base", appdir), "re");
+  if (!file) {
+    return NULL;
+  }
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t linelen = getline(&line, &linecap, file);
+  fclose(file);
+  char *name = linelen > 0 ? arena_strndup(&launcher_arena, line, linelen)
+                           : NULL;
+  free(line);
+  if (!name) {
+    return NULL;
+  }
+  name = trim_in_place(name);
+  die_if(name[0] == 0 || strchr(name, '/'), "bad base layer name in %s/base",
+         appdir);
+  return name;
+}
+
+static char *find_layer(const char *name) {
+  struct string_set dirs = {.arena = &launcher_arena};
+  const char *env = getenv("NIX_APPIMAGE_LAYERS_PATH");
+  if (env) {
+    char *copy = strprintf("%s", env);
+    for (char *dir = strtok(copy, ":"); dir; dir = strtok(NULL, ":")) {
+      string_set_add(&dirs, dir);
+    }
+  }
+  const char *image = getenv("APPIMAGE");
+  if (image && image[0] == '/') {
+    string_set_add(&dirs, dirname(strprintf("%s", image)));
+  }
+  const char *xdg = getenv("XDG_DATA_HOME");
+  const char *home = getenv("HOME");
+  if (xdg && xdg[0] == '/') {
+    string_set_add(&dirs, strprintf("%s/nix-appimage/layers", xdg));
+  } else if (home && home[0] == '/') {
+    string_set_add(&dirs, strprintf("%s/.local/share/nix-appimage/layers", home));
+  }
+
+  for (size_t i = 0; i < dirs.len; i++) {
+    char *path = strprintf("%s/%s", dirs.items[i], name);
+    if (access(path, X_OK) == 0) {
+      return path;
+    }
+    if (ld_debug_enabled()) {
+      fprintf(stderr, "%s: no base layer at %s\n", argv0, path);
+    }
+  }
+  return NULL;
+}
+
+// mount a layer (or any other AppImage) with its own runtime, returning the
+// mount point. The runtime keeps it mounted until it's killed, which happens
+// when we (or rather, the program we exec into) exit.
+static char *mount_appimage(const char *layer) {
+  int fds[2];
+  die_if(pipe2(fds, O_CLOEXEC) < 0, "cannot create pipe");
+
+  pid_t parent = getpid();
+  pid_t pid = fork();
+  die_if(pid < 0, "cannot fork");
+  if (pid == 0) {
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != parent) {
+      _exit(1);
+    }
+    dup2(fds[1], STDOUT_FILENO);
+    // these describe our image, not the layer
+    unsetenv("TARGET_APPIMAGE");
+    unsetenv("NIX_APPIMAGE_RUN_CACHE_FILL");
+    unsetenv("NIX_APPIMAGE_ZYGOTE_SOCKET");
+    execl(layer, layer, "--appimage-mount", (char *)NULL);
+    fprintf(stderr, "%s: cannot exec %s: %s\n", argv0, layer, strerror(errno));
+    _exit(127);
+  }
+  close(fds[1]);
+
+  // the runtime prints the mount point once it's mounted
+  FILE *out = fdopen(fds[0], "r");
+  die_if(!out, "cannot fdopen");
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t linelen = getline(&line, &linecap, out);
+  fclose(out);
+  die_if(linelen <= 0, "cannot mount %s", layer);
+
+  char *mountpoint = trim_in_place(arena_strndup(&launcher_arena, line, linelen));
+  free(line);
+  return mountpoint;
+}
+
+static void mount_base_layer(void) {
+  const char *name = read_base_name();
+  if (!name) {
+    return;
+  }
+
+  uint64_t start = trace_begin();
+  char *layer = find_layer(name);
+  die_if(!layer,
+         "cannot find base layer %s, put it next to this AppImage or in "
+         "$NIX_APPIMAGE_LAYERS_PATH",
+         name);
+  base_store = strprintf("%s/nix/store", mount_appimage(layer));
+  trace_end("base-layer", start, NULL);
+}
+
+// lowerdir option for an overlay of the image's store on top of the base
+// layer's, and optionally the host's
+static char *layered_lowerdirs(const char *host_store) {
+  char *store = strprintf("%s/nix/store", appdir);
+  return strprintf("lowerdir=%s:%s%s%s", store, base_store,
+                   host_store ? ":" : "", host_store ? host_store : "");
+}
+
+// replicate every store path in `store` into `to`
+static void replicate_store(const char *store, const char *to) {
+  DIR *dir = opendir(store);
+  die_if(!dir, "cannot open %s", store);
+  struct dirent *entry;
+  while ((entry = readdir(dir))) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+      continue;
+    }
+    // the image's paths come first, so on a clash (which mkAppImage
+    // shouldn't let happen) they win like they do in the overlay
+    if (faccessat(AT_FDCWD, strprintf("%s/%s", to, entry->d_name), F_OK,
+                  AT_SYMLINK_NOFOLLOW) == 0) {
+      continue;
+    }
+    replicate_entry(dirfd(dir), store, to, entry);
+  }
+  closedir(dir);
+}
+
+// mount the image's store merged with the base layer's at `to`, returning how
+static const char *mount_layered_store(const char *to) {
+  if (mount("overlay", to, "overlay", MS_RDONLY, layered_lowerdirs(NULL)) ==
+      0) {
+    return "overlay";
+  }
+  if (ld_debug_enabled()) {
+    fprintf(stderr, "%s: overlay on %s: %s\n", argv0, to, strerror(errno));
+  }
+
+  // without overlayfs (Linux < 5.11 in a user namespace), bind every store
+  // path of both into a tmpfs
+  die_if(mount("tmpfs", to, "tmpfs", 0, "mode=0755") < 0, "mount tmpfs -> %s",
+         to);
+  replicate_store(strprintf("%s/nix/store", appdir), to);
+  replicate_store(base_store, to);
+  return "entries";
+}
+
+// Exec ------------------------------------------------------------------------
+//
+// Besides the default `entrypoint`, an image can have named ones, as
+// `entrypoints/<name>` links. Like busybox, the one to run is picked by the
+// name the image was started as: the runtime passes that on in $ARGV0, so a
+// `dig` symlink to the image runs entrypoints/dig. Other names get the
+// default.
+
+static const char *select_entrypoint(void) {
+  const char *name = getenv("ARGV0");
+  if (!name || name[0] == 0) {
+    name = argv0;
+  }
+  const char *slash = strrchr(name, '/');
+  if (slash) {
+    name = slash + 1;
+  }
+
+  if (name[0] != 0 && strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+    char *named = strprintf("%s/entrypoints/%s", appdir, name);
+    struct stat statbuf;
+    if (lstat(named, &statbuf) == 0 && S_ISLNK(statbuf.st_mode)) {
+      return named;
+    }
+  }
+  return strprintf("%s/entrypoint", appdir);
+}
+
+
+// With NIX_APPIMAGE_EXEC_THROUGH_LD=1, rather than exporting LD_LIBRARY_PATH,
+// a dynamically linked entrypoint is started through its ld.so, which is
+// given the library path with --library-path. That way the host's library
+// directories only apply to the bundled program, and not to every program it
+// runs (shells, compilers, ...), which would all probe them for each library,
+// and might load the wrong ones. It's opt-in, since /proc/self/exe and
+// AT_EXECFN are then ld.so, which breaks programs that re-exec themselves.
+
+// returns if exe has to be started with LD_LIBRARY_PATH instead
+static void exec_through_interp(const char *exe, char **argv) {
+  if (!exec_through_ld) {
+    return;
+  }
+
+  size_t argc = 0;
+  while (argv[argc]) {
+    argc++;
+  }
+  const char **ld_argv =
+      arena_alloc(&launcher_arena, (argc + 6) * sizeof(*ld_argv));
+  ld_argv[0] = entrypoint_interp;
+  ld_argv[1] = "--argv0";
+  ld_argv[2] = argv[0];
+  ld_argv[3] = "--library-path";
+  ld_argv[4] = ld_library_path;
+  ld_argv[5] = exe;
+  // including the NULL at the end
+  for (size_t i = 1; i <= argc; i++) {
+    ld_argv[5 + i] = argv[i];
+  }
+
+  if (ld_debug_enabled()) {
+    fprintf(stderr, "%s: starting %s through %s\n", argv0, exe,
+            entrypoint_interp);
+  }
+  execv(entrypoint_interp, (char **)ld_argv);
+  if (ld_debug_enabled()) {
+    fprintf(stderr, "%s: cannot exec %s: %s\n", argv0, entrypoint_interp,
+            strerror(errno));
+  }
+}
+
+static void exec_entrypoint(char **argv) {
+  // For better error messages, we wanna get what entrypoint points to
+  char exe[PATH_MAX + 1];
+  ssize_t exe_size = readlink(entrypoint, exe, PATH_MAX);
+  die_if(exe_size < 0, "cannot read link %s", entrypoint);
+  exe[exe_size] = 0;
+
+  // the exec either replaces us or fails, so this is the last thing we know
+  trace_end("exec", trace_begin(), NULL);
+  if (ld_library_path) {
+    exec_through_interp(exe, argv);
+    if (setenv("LD_LIBRARY_PATH", ld_library_path, 1) < 0) {
+      fprintf(stderr, "%s: unable to set LD_LIBRARY_PATH: %s\n", argv0,
+              strerror(errno));
+    } else if (ld_debug_enabled()) {
+      fprintf(stderr, "%s: LD_LIBRARY_PATH='%s'\n", argv0, ld_library_path);
+    }
+  }
+  execv(exe, argv);
+  die_if(true, "cannot exec %s", exe);
+}
+
+// /nix-only mode --------------------------------------------------------------
+//
+// With NIX_APPIMAGE_MOUNT=nix-only, rather than replicating the whole root
+// into a tmpfs and chrooting, the bundled store is mounted straight over the
+// host's /nix in our mount namespace, so setup costs the same however many
+// mounts the host has. If the host has a store of its own, the two are merged
+// with a read-only overlay (unprivileged overlayfs needs Linux >= 5.11),
+// otherwise or if that fails, the bundled /nix replaces the host's, as it does
+// in the chroot. Without a /nix on the host there's nothing to mount over, and
+// we can't create one, so we fall back to the chroot.
+
+static bool nix_only_requested(void) {
+  const char *env = getenv("NIX_APPIMAGE_MOUNT");
+  return env && strcmp(env, "nix-only") == 0;
+}
+
+static bool is_dir(const char *path) {
+  struct stat statbuf;
+  return stat(path, &statbuf) == 0 && S_ISDIR(statbuf.st_mode);
+}
+
+// returns the mode used, or NULL if the host has no /nix
+static const char *mount_nix_only(void) {
+  if (!is_dir("/nix")) {
+    if (ld_debug_enabled()) {
+      fprintf(stderr, "%s: no /nix on host, falling back to chroot\n", argv0);
+    }
+    return NULL;
+  }
+
+  // keep our mounts from propagating back to the host
+  die_if(mount(NULL, "/", NULL, MS_REC | MS_SLAVE, NULL) < 0,
+         "cannot make / slave");
+
+  char *store_from = strprintf("%s/nix/store", appdir);
+  if (is_dir("/nix/store")) {
+    // leftmost lowerdir wins, so bundled paths shadow the host's
+    char *opts = base_store ? layered_lowerdirs("/nix/store")
+                            : strprintf("lowerdir=%s:/nix/store", store_from);
+    if (mount("overlay", "/nix/store", "overlay", MS_RDONLY, opts) == 0) {
+      return "overlay";
+    }
+    if (ld_debug_enabled()) {
+      fprintf(stderr, "%s: overlay on /nix/store: %s\n", argv0,
+              strerror(errno));
+    }
+  }
+
+  if (base_store) {
+    // a bind can't merge in the base layer, but the chroot can
+    if (ld_debug_enabled()) {
+      fprintf(stderr, "%s: cannot overlay base layer, falling back to chroot\n",
+              argv0);
+    }
+    return NULL;
+  }
+
+  char *nix_from = strprintf("%s/nix", appdir);
+  die_if(bind_mount(nix_from, "/nix") < 0, "mount %s -> /nix", nix_from);
+  return "bind";
+}
+
+// Run cache -------------------------------------------------------------------
+//
+// A runtime with the run cache enabled (see
+// runtimes/appimage-type2-runtime/run-cache.c) that finds no cached copy of
+// the image sets NIX_APPIMAGE_RUN_CACHE_FILL to the entry it wants. We then
+// copy appdir there from a detached background process, so this launch isn't
+// slowed down, and the next one can start from the copy without FUSE. The
+// copier inherits the runtime's keepalive pipe, so the mount outlives the app
+// until the copy is done.
+//
+// Entries are filled under a temporary name and renamed into place once
+// complete and checked, with a marker holding the key and how many files and
+// bytes were copied, which the runtime can check again with
+// NIX_APPIMAGE_RUN_CACHE_VERIFY=1. Fills are serialized by <entry>.lock,
+// which stays around as long as the entry does. Afterwards, least recently
+// used entries are evicted until the cache fits in
+// NIX_APPIMAGE_RUN_CACHE_SIZE MiB, skipping those in use.
+
+#define RUN_CACHE_MARKER ".nix-appimage-run-cache"
+
+static const unsigned long long run_cache_default_mib = 4096;
+static const long run_cache_max_workers = 8;
+
+struct copy_job {
+  const char *from;
+  const char *to;
+  mode_t mode;
+};
+
+struct copy_plan {
+  struct copy_job *files;
+  size_t nfiles;
+  size_t cap;
+  struct copy_job *dirs; // modes are applied once their contents are copied
+  size_t ndirs;
+  size_t dirs_cap;
+  unsigned long long bytes; // of all files
+};
+
+static void copy_plan_push(struct copy_job **jobs, size_t *len, size_t *cap,
+                           struct copy_job job) {
+  if (*len == *cap) {
+    size_t new_cap = *cap == 0 ? 256 : *cap * 2;
+    struct copy_job *new_jobs = arena_alloc(&launcher_arena,
+                                            new_cap * sizeof(*new_jobs));
+    if (*len > 0) {
+      memcpy(new_jobs, *jobs, *len * sizeof(*new_jobs));
+    }
+    *jobs = new_jobs;
+    *cap = new_cap;
+  }
+  (*jobs)[(*len)++] = job;
+}
+
+// recreate the directories and symlinks under `from`, and list its files
+static int plan_copy(struct copy_plan *plan, const char *from,
+                     const char *to) {
+  DIR *dir = opendir(from);
+  if (!dir) {
+    return -1;
+  }
+
+  int ret = 0;
+  struct dirent *entry;
+  while (ret == 0 && (entry = readdir(dir))) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+      continue;
+    }
+    char *src = strprintf("%s/%s", from, entry->d_name);
+    char *dst = strprintf("%s/%s", to, entry->d_name);
+
+    struct stat statbuf;
+    if (fstatat(dirfd(dir), entry->d_name, &statbuf, AT_SYMLINK_NOFOLLOW) < 0) {
+      ret = -1;
+    } else if (S_ISDIR(statbuf.st_mode)) {
+      ret = mkdir(dst, 0700) < 0 ? -1 : plan_copy(plan, src, dst);
+      copy_plan_push(&plan->dirs, &plan->ndirs, &plan->dirs_cap,
+                     (struct copy_job){src, dst, statbuf.st_mode & 07777});
+    } else if (S_ISLNK(statbuf.st_mode)) {
+      char target[PATH_MAX + 1];
+      ssize_t len = readlinkat(dirfd(dir), entry->d_name, target, PATH_MAX);
+      if (len < 0) {
+        ret = -1;
+      } else {
+        target[len] = 0;
+        ret = symlink(target, dst);
+      }
+    } else if (S_ISREG(statbuf.st_mode)) {
+      copy_plan_push(&plan->files, &plan->nfiles, &plan->cap,
+                     (struct copy_job){src, dst, statbuf.st_mode & 07777});
+      plan->bytes += statbuf.st_size;
+    }
+  }
+
+  closedir(dir);
+  return ret;
+}
+
+static int copy_file(const struct copy_job *job) {
+  int in = open(job->from, O_RDONLY | O_CLOEXEC);
+  if (in < 0) {
+    return -1;
+  }
+  int out = open(job->to, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  if (out < 0) {
+    close(in);
+    return -1;
+  }
+
+  static char buf[128 * 1024];
+  int ret = 0;
+  ssize_t n;
+  while ((n = read(in, buf, sizeof(buf))) > 0) {
+    for (ssize_t done = 0; done < n;) {
+      ssize_t written = write(out, buf + done, n - done);
+      if (written < 0) {
+        ret = -1;
+        break;
+      }
+      done += written;
+    }
+    if (ret != 0) {
+      break;
+    }
+  }
+  if (n < 0 || fchmod(out, job->mode) < 0) {
+    ret = -1;
+  }
+  if (close(out) < 0) {
+    ret = -1;
+  }
+  close(in);
+  return ret;
+}
+
+// count the regular files under `path`, and add up their sizes
+static int count_tree(const char *path, unsigned long long *files,
+                      unsigned long long *bytes) {
+  DIR *dir = opendir(path);
+  if (!dir) {
+    return -1;
+  }
+
+  int ret = 0;
+  struct dirent *entry;
+  while (ret == 0 && (entry = readdir(dir))) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+      continue;
+    }
+    struct stat statbuf;
+    if (fstatat(dirfd(dir), entry->d_name, &statbuf, AT_SYMLINK_NOFOLLOW) < 0) {
+      ret = -1;
+    } else if (S_ISDIR(statbuf.st_mode)) {
+      ret = count_tree(strprintf("%s/%s", path, entry->d_name), files, bytes);
+    } else if (S_ISREG(statbuf.st_mode)) {
+      (*files)++;
+      *bytes += statbuf.st_size;
+    }
+  }
+  closedir(dir);
+  return ret;
+}
+
+// Copy the planned files into `to` with a few worker processes, each taking
+// every nworkers-th file, and check that all of them made it, in full. This
+// is the only time the entry's files are counted: the marker records what
+// was found here, and launches trust it.
+static int copy_files(const struct copy_plan *plan, const char *to) {
+  long nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nworkers < 1) {
+    nworkers = 1;
+  }
+  if (nworkers > run_cache_max_workers) {
+    nworkers = run_cache_max_workers;
+  }
+
+  int ret = 0;
+  for (long worker = 0; worker < nworkers; worker++) {
+    pid_t pid = fork();
+    if (pid < 0) {
+      ret = -1;
+      nworkers = worker;
+      break;
+    }
+    if (pid == 0) {
+      for (size_t i = worker; i < plan->nfiles; i += nworkers) {
+        if (copy_file(&plan->files[i]) != 0) {
+          _exit(1);
+        }
+      }
+      _exit(0);
+    }
+  }
+
+  int status;
+  while (wait(&status) > 0) {
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      ret = -1;
+    }
+  }
+
+  unsigned long long files = 0, bytes = 0;
+  if (ret == 0 && (count_tree(to, &files, &bytes) < 0 ||
+                   files != plan->nfiles || bytes != plan->bytes)) {
+    errno = EIO;
+    ret = -1;
+  }
+  return ret;
+}
+
+// like rm -rf, except it also copes with read-only directories
+static void remove_tree(const char *path) {
+  struct stat statbuf;
+  if (lstat(path, &statbuf) < 0) {
+    return;
+  }
+  if (!S_ISDIR(statbuf.st_mode)) {
+    unlink(path);
+    return;
+  }
+
+  chmod(path, 0700);
+  DIR *dir = opendir(path);
+  if (dir) {
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+      if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+        remove_tree(strprintf("%s/%s", path, entry->d_name));
+      }
+    }
+    closedir(dir);
+  }
+  rmdir(path);
+}
+
+static unsigned long long tree_bytes(const char *path) {
+  struct stat statbuf;
+  if (lstat(path, &statbuf) < 0) {
+    return 0;
+  }
+  unsigned long long total = (unsigned long long)statbuf.st_blocks * 512;
+  if (!S_ISDIR(statbuf.st_mode)) {
+    return total;
+  }
+
+  DIR *dir = opendir(path);
+  if (dir) {
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+      if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+        total += tree_bytes(strprintf("%s/%s", path, entry->d_name));
+      }
+    }
+    closedir(dir);
+  }
+  return total;
+}
+
+struct cache_entry {
+  const char *path;
+  struct timespec mtime;
+  unsigned long long bytes;
+};
+
+static int cache_entry_newer(const void *a, const void *b) {
+  const struct cache_entry *x = a, *y = b;
+  if (x->mtime.tv_sec != y->mtime.tv_sec) {
+    return x->mtime.tv_sec > y->mtime.tv_sec ? -1 : 1;
+  }
+  return x->mtime.tv_nsec > y->mtime.tv_nsec ? -1
+         : x->mtime.tv_nsec < y->mtime.tv_nsec ? 1
+                                               : 0;
+}
+
+// Take the lock that serializes filling `entry`, or return -1 if another
+// launch holds it. The lock file may have been removed (by eviction) between
+// opening it and getting the lock, in which case the next filler has a new
+// one, and we'd be filling alongside it; so it has to be the one still there.
+static int lock_fill(const char *entry) {
+  const char *path = strprintf("%s.lock", entry);
+  while (true) {
+    int lock = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+    if (lock < 0) {
+      return -1;
+    }
+    struct stat locked, current;
+    if (flock(lock, LOCK_EX | LOCK_NB) < 0 || fstat(lock, &locked) < 0) {
+      close(lock);
+      return -1;
+    }
+    if (stat(path, &current) == 0 && current.st_dev == locked.st_dev &&
+        current.st_ino == locked.st_ino) {
+      return lock;
+    }
+    close(lock);
+  }
+}
+
+// remove the fill lock of an evicted entry, unless a fill holds it
+static void remove_fill_lock(const char *entry) {
+  int lock = lock_fill(entry);
+  if (lock >= 0) {
+    unlink(strprintf("%s.lock", entry));
+    close(lock);
+  }
+}
+
+static void evict_run_cache(const char *cache) {
+  unsigned long long budget = run_cache_default_mib;
+  const char *env = getenv("NIX_APPIMAGE_RUN_CACHE_SIZE");
+  if (env && env[0] != 0) {
+    budget = strtoull(env, NULL, 10);
+  }
+  budget *= 1024 * 1024;
+
+  DIR *dir = opendir(cache);
+  if (!dir) {
+    return;
+  }
+  struct cache_entry *entries = NULL;
+  size_t len = 0;
+  size_t cap = 0;
+  struct dirent *dirent;
+  while ((dirent = readdir(dir))) {
+    // only complete entries, which are named by their 16 digit key
+    if (strspn(dirent->d_name, "0123456789abcdef") != 16) {
+      continue;
+    }
+    char *path = strprintf("%s/%s", cache, dirent->d_name);
+    if (strncmp(dirent->d_name + 16, ".evict-", 7) == 0) {
+      // the runtime moved it here as broken, or an eviction was interrupted
+      remove_tree(path);
+      continue;
+    }
+    if (dirent->d_name[16] != 0) {
+      continue;
+    }
+    struct stat statbuf;
+    if (stat(path, &statbuf) < 0 || !S_ISDIR(statbuf.st_mode)) {
+      continue;
+    }
+    if (len == cap) {
+      cap = cap == 0 ? 16 : cap * 2;
+      struct cache_entry *grown = arena_alloc(&launcher_arena,
+                                              cap * sizeof(*grown));
+      if (len > 0) {
+        memcpy(grown, entries, len * sizeof(*grown));
+      }
+      entries = grown;
+    }
+    entries[len++] = (struct cache_entry){path, statbuf.st_mtim, 0};
+  }
+  closedir(dir);
+  if (len == 0) {
+    return;
+  }
+
+  qsort(entries, len, sizeof(*entries), cache_entry_newer);
+
+  // the newest entry (usually the one just filled) is always kept
+  unsigned long long used = 0;
+  for (size_t i = 0; i < len; i++) {
+    used += tree_bytes(entries[i].path);
+    if (i == 0 || used <= budget) {
+      continue;
+    }
+
+    int fd = open(strprintf("%s/" RUN_CACHE_MARKER, entries[i].path),
+                  O_RDONLY | O_CLOEXEC);
+    if (fd >= 0 && flock(fd, LOCK_EX | LOCK_NB) < 0) {
+      // still in use, try again next time
+      close(fd);
+      continue;
+    }
+
+    // unpublish first, so nothing starts using it while it's removed
+    char *trash = strprintf("%s.evict-%d", entries[i].path, (int)getpid());
+    if (rename(entries[i].path, trash) == 0) {
+      remove_tree(trash);
+      remove_fill_lock(entries[i].path);
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+}
+
+static int fill_run_cache(const char *entry) {
+  char *cache = dirname(strprintf("%s", entry));
+  const char *key = basename(strprintf("%s", entry));
+
+  // create the cache dir and its parents if needed
+  for (char *slash = strchr(cache + 1, '/'); slash;
+       slash = strchr(slash + 1, '/')) {
+    *slash = 0;
+    mkdir(cache, 0700);
+    *slash = '/';
+  }
+  mkdir(cache, 0700);
+
+  // only one launch fills a given entry at a time
+  int lock = lock_fill(entry);
+  if (lock < 0) {
+    return -1;
+  }
+  if (access(entry, F_OK) == 0) {
+    return 0;
+  }
+
+  char *tmp = strprintf("%s.tmp-%d", entry, (int)getpid());
+  struct copy_plan plan = {0};
+  int ret = mkdir(tmp, 0700) < 0 ? -1 : plan_copy(&plan, appdir, tmp);
+  if (ret == 0) {
+    ret = copy_files(&plan, tmp);
+  }
+  // deepest directories were pushed first
+  for (size_t i = 0; ret == 0 && i < plan.ndirs; i++) {
+    ret = chmod(plan.dirs[i].to, plan.dirs[i].mode);
+  }
+
+  if (ret == 0) {
+    const char *marker =
+        strprintf("%s %zu %llu\n", key, plan.nfiles, plan.bytes);
+    int fd = open(strprintf("%s/" RUN_CACHE_MARKER, tmp),
+                  O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0444);
+    ret = fd < 0 || write(fd, marker, strlen(marker)) != (ssize_t)strlen(marker)
+              ? -1
+              : 0;
+    if (fd >= 0 && close(fd) < 0) {
+      ret = -1;
+    }
+  }
+
+  if (ret == 0 && rename(tmp, entry) < 0) {
+    ret = -1;
+  }
+  if (ret != 0) {
+    if (ld_debug_enabled()) {
+      fprintf(stderr, "%s: cannot fill run cache %s: %s\n", argv0, entry,
+              strerror(errno));
+    }
+    remove_tree(tmp);
+    return -1;
+  }
+
+  // the lock file stays until the entry is evicted, see lock_fill()
+  close(lock);
+  evict_run_cache(cache);
+  return 0;
+}
+
+static void start_run_cache_fill(void) {
+  const char *env = getenv("NIX_APPIMAGE_RUN_CACHE_FILL");
+  if (!env || env[0] != '/') {
+    return;
+  }
+  char *entry = strprintf("%s", env);
+  // the app shouldn't see this, nor pass it on to other images
+  unsetenv("NIX_APPIMAGE_RUN_CACHE_FILL");
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    return;
+  }
+  if (pid > 0) {
+    waitpid(pid, NULL, 0);
+    return;
+  }
+
+  // fork again so the copier is reparented away from the app, which would
+  // otherwise end up with an unexpected child
+  if (fork() != 0) {
+    _exit(0);
+  }
+  setsid();
+  if (nice(10) < 0) {
+    // being niced is just a courtesy
+  }
+  int null = open("/dev/null", O_RDWR | O_CLOEXEC);
+  if (null >= 0) {
+    dup2(null, STDIN_FILENO);
+    dup2(null, STDOUT_FILENO);
+    if (!ld_debug_enabled()) {
+      dup2(null, STDERR_FILENO);
+    }
+  }
+  if (trace_fd >= 0) {
+    // the app may reuse our trace fd number, so don't write to it
+    trace_fd = -1;
+  }
+
+  _exit(fill_run_cache(entry) == 0 ? 0 : 1);
+}
+
+// Prefetching -----------------------------------------------------------------
+//
+// An image built with a startupProfile lists the files its program uses at
+// startup in <appdir>/startup-files, in the order it uses them, each with how
+// many bytes of it are used (0 if that isn't known). Nothing reads them until
+// the program is exec'd, so the disk, or the FUSE server, would sit idle while
+// we unshare and set up the root. Instead, a background process reads them
+// into the page cache in the meantime: it first asks for readahead of all of
+// them, so they're fetched in parallel, and then reads them, which waits for
+// that and makes up for readahead the kernel dropped. Each file is kept open
+// between the two, so it's only looked up once.
+
+// in case the profile is of a program that reads a lot at startup
+static const off_t max_prefetch_bytes = 512 << 20;
+
+static bool prefetch_enabled(void) {
+  const char *env = getenv("NIX_APPIMAGE_PREFETCH");
+  return !(env && strcmp(env, "0") == 0);
+}
+
+struct prefetch_file {
+  int fd;
+  off_t len;
+};
+
+static size_t read_startup_files(FILE *list, struct prefetch_file **files) {
+  size_t len = 0, cap = 0;
+  off_t total = 0;
+  char *line = NULL;
+  size_t linecap = 0;
+  while (total < max_prefetch_bytes && getline(&line, &linecap, list) != -1) {
+    char *space = strrchr(line, ' ');
+    if (!space || line[0] != '/') {
+      continue;
+    }
+    *space = 0;
+    long long bytes = strtoll(space + 1, NULL, 10);
+
+    int fd = open(strprintf("%s%s", appdir, line), O_RDONLY | O_CLOEXEC);
+    struct stat statbuf;
+    if (fd < 0) {
+      continue;
+    }
+    if (fstat(fd, &statbuf) < 0 || !S_ISREG(statbuf.st_mode)) {
+      close(fd);
+      continue;
+    }
+    off_t file_len =
+        bytes > 0 && bytes < statbuf.st_size ? bytes : statbuf.st_size;
+    if (file_len > max_prefetch_bytes - total) {
+      file_len = max_prefetch_bytes - total;
+    }
+    posix_fadvise(fd, 0, file_len, POSIX_FADV_WILLNEED);
+
+    if (len == cap) {
+      cap = cap ? cap * 2 : 256;
+      struct prefetch_file *grown =
+          arena_alloc(&launcher_arena, cap * sizeof(*grown));
+      memcpy(grown, *files, len * sizeof(*grown));
+      *files = grown;
+    }
+    (*files)[len++] = (struct prefetch_file){fd, file_len};
+    total += file_len;
+  }
+  free(line);
+  return len;
+}
+
+static void prefetch_startup_files(FILE *list) {
+  uint64_t start = trace_begin();
+  struct prefetch_file *files = NULL;
+  size_t len = read_startup_files(list, &files);
+  fclose(list);
+
+  static char buf[128 * 1024];
+  off_t total = 0;
+  for (size_t i = 0; i < len; i++) {
+    int fd = files[i].fd;
+    for (off_t pos = 0; pos < files[i].len;) {
+      size_t want = files[i].len - pos < (off_t)sizeof(buf)
+                        ? (size_t)(files[i].len - pos)
+                        : sizeof(buf);
+      ssize_t n = pread(fd, buf, want, pos);
+      if (n <= 0) {
+        break;
+      }
+      pos += n;
+      total += n;
+    }
+    close(fd);
+  }
+  trace_end("prefetch", start, ",\"files\":%zu,\"bytes\":%lld", len,
+            (long long)total);
+}
+
+static void start_prefetch(void) {
+  if (!prefetch_enabled()) {
+    return;
+  }
+  FILE *list = fopen(strprintf("%s/startup-files", appdir), "re");
+  if (!list) {
+    return;
+  }
 
-  extend_ld_library_path();
+  pid_t pid = fork();
+  if (pid != 0) {
+    fclose(list);
+    if (pid > 0) {
+      waitpid(pid, NULL, 0);
+    }
+    return;
+  }
+  // fork again so that the app doesn't end up with an unexpected child
+  if (fork() != 0) {
+    _exit(0);
+  }
+  setsid();
+  int null = open("/dev/null", O_RDWR | O_CLOEXEC);
+  if (null >= 0) {
+    dup2(null, STDIN_FILENO);
+    dup2(null, STDOUT_FILENO);
+    if (!ld_debug_enabled()) {
+      dup2(null, STDERR_FILENO);
+    }
+  }
+  // the files stay open until they've been read, and a profile can list more
+  // of them than the default soft limit
+  struct rlimit nofile;
+  if (getrlimit(RLIMIT_NOFILE, &nofile) == 0) {
+    nofile.rlim_cur = nofile.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &nofile);
+  }
+  // unlike the run cache copier, this keeps tracing: its copy of the trace fd
+  // stays what it is whatever the app does with its own, and the "prefetch"
+  // line shows how it lined up with the rest of startup
+
+  prefetch_startup_files(list);
+  _exit(0);
+}
+
+// Namespaces and root --------------------------------------------------------
 
+// Create new mount namespace (and potentially user namespace if not root)
+static void enter_namespaces(uid_t uid, gid_t gid) {
   int clonens = CLONE_NEWNS;
   if (uid != 0) {
     // create new user ns so we can mount() in userland
     clonens |= CLONE_NEWUSER;
   }
 
-  // Create new mount namespace (and potentially user namespace if not root)
+  mount_base_layer();
+
+  uint64_t start = trace_begin();
   die_if(unshare(clonens) < 0, "cannot unshare");
+  trace_end("unshare", start, NULL);
 
   if (uid != 0) {
+    start = trace_begin();
+
     // UID/GID Mapping
     // -----------------------------------------------------------
 
@@ -588,20 +2525,22 @@ void child_main(char **argv) {
     die_if(write_to("/proc/self/setgroups", "deny"), "cannot write setgroups");
     die_if(write_to("/proc/self/gid_map", "%d %d 1\n", uid, gid),
            "cannot write gid_map");
-  }
 
-  // Mountpoint ----------------------------------------------------------------
+    trace_end("idmap", start, NULL);
+  }
+}
 
-  // tmpfs so we don't need to cleanup
-  die_if(mount("tmpfs", mountroot, "tmpfs", 0, 0) < 0, "mount tmpfs -> %s",
-         mountroot);
-  // make unbindable to both prevent event propagation as well as mount
-  // explosion
-  die_if(mount(mountroot, mountroot, "none", MS_UNBINDABLE, 0) < 0,
-         "mount tmpfs bind -> %s", mountroot);
+// recreate the root filesystem under mountroot, with our /nix
+static void prepare_root(void) {
+  uint64_t start = trace_begin();
+  mount_tmpfs(mountroot);
+  trace_end("tmpfs", start, ",\"mount_api\":%s",
+            have_mount_api ? "true" : "false");
 
   // copy over root directories
+  uint64_t root_start = trace_begin();
   DIR *rootdir = opendir("/");
+  die_if(!rootdir, "cannot open /");
   struct dirent *rootentry;
   while ((rootentry = readdir(rootdir))) {
     // ignore . and .. and nix
@@ -611,82 +2550,364 @@ void child_main(char **argv) {
       continue;
     }
 
-    char *from = strprintf("/%s", rootentry->d_name);
-    char *to = strprintf("%s/%s", mountroot, rootentry->d_name);
-
-    // we don't treat failure of the below bind as an actual failure, since
-    // our logic not robust enough to handle weird filesystem scenarios
-
-    // TODO imitate symlinks as symlinks
-
-    struct stat statbuf;
-    if (stat(from, &statbuf) < 0) {
-      fprintf(stderr, "%s: stat %s: %s\n", argv0, from, strerror(errno));
-    } else {
-      if (S_ISDIR(statbuf.st_mode)) {
-        die_if(mkdir(to, statbuf.st_mode & ~S_IFMT) < 0, "mkdir %s", to);
-        if (mount(from, to, "none", MS_BIND | MS_REC, 0) < 0) {
-          fprintf(stderr, "%s: mount %s -> %s: %s\n", argv0, from, to,
-                  strerror(errno));
-        }
-      } else {
-        // effectively touch
-        int fd = creat(to, statbuf.st_mode & ~S_IFMT);
-        if (fd == -1) {
-          fprintf(stderr, "%s: creat %s: %s\n", argv0, to, strerror(errno));
-        } else {
-          close(fd);
-          if (mount(from, to, "none", MS_BIND | MS_REC, 0) < 0) {
-            fprintf(stderr, "%s: mount %s -> %s: %s\n", argv0, from, to,
-                    strerror(errno));
-          }
-        }
-      }
+    start = trace_begin();
+    const char *kind = replicate_root_entry(dirfd(rootdir), rootentry);
+    if (trace_fd >= 0) {
+      char name[NAME_MAX * 6 + 1];
+      json_escape(name, sizeof(name), rootentry->d_name);
+      trace_end("root-entry", start, ",\"name\":\"%s\",\"kind\":\"%s\"", name,
+                kind);
     }
-
-    free(from);
-    free(to);
   }
+  closedir(rootdir);
+  trace_end("root", root_start, NULL);
 
   // mount in /nix
+  start = trace_begin();
   char *nix_from = strprintf("%s/nix", appdir);
   char *nix_to = strprintf("%s/nix", mountroot);
 
   die_if(mkdir(nix_to, 0777) < 0, "mkdir %s", nix_to);
-  die_if(mount(nix_from, nix_to, "none", MS_BIND | MS_REC, 0) < 0,
-         "mount %s -> %s", nix_from, nix_to);
+  die_if(bind_mount(nix_from, nix_to) < 0, "mount %s -> %s", nix_from,
+         nix_to);
+  trace_end("nix-bind", start, NULL);
+
+  if (base_store) {
+    start = trace_begin();
+    char *store_to = strprintf("%s/store", nix_to);
+    const char *mode = mount_layered_store(store_to);
+    trace_end("base-merge", start, ",\"mode\":\"%s\"", mode);
+  }
+
+  if (host_libs.len > 0) {
+    start = trace_begin();
+    link_host_libs();
+    trace_end("host-libs", start, ",\"libs\":%zu", host_libs.len);
+  }
+}
 
-  free(nix_from);
-  free(nix_to);
+// chroot into a root set up by prepare_root(), given as a directory fd, and cd
+// back to where we were
+static void enter_root(int rootfd, const char *cwd) {
+  // chroot
+  uint64_t start = trace_begin();
+  die_if(fchdir(rootfd) < 0 || chroot(".") < 0, "cannot chroot %s", mountroot);
 
-  // Chroot --------------------------------------------------------------------
+  // cd back again
+  die_if(chdir(cwd) < 0, "cannot chdir %s", cwd);
+  trace_end("chroot", start, NULL);
+}
 
-  // save where we were so we can cd into it
+// Zygote ----------------------------------------------------------------------
+//
+// With NIX_APPIMAGE_ZYGOTE=1, the type2 runtime first asks a daemon for this
+// image whether it has a root set up already (see zygote.c there). If there's
+// no daemon, the runtime mounts the image as usual and names the socket one
+// should listen on in NIX_APPIMAGE_ZYGOTE_SOCKET, and we start it next to the
+// app. The daemon mounts its own copy of the image, sets up the namespaces and
+// root once, and hands each client its mount point, and fds for its mount
+// namespace, root and user namespace over SCM_RIGHTS, along with the host
+// libraries it found. The client's runtime then execs AppRun from the
+// daemon's mount, with the fds in NIX_APPIMAGE_ZYGOTE_FDS and the libraries in
+// NIX_APPIMAGE_ZYGOTE_LIBS, and we setns() into them instead of doing all
+// that.
+//
+// Clients keep their connection open, and the app inherits it, so the daemon
+// (and with it the mount) stays around as long as any of them runs, and then
+// for another NIX_APPIMAGE_ZYGOTE_IDLE seconds. The socket is named after the
+// image's hash, so a rebuilt image gets a new daemon and the old one idles out.
+
+#define ZYGOTE_MAX_CLIENTS 1024
+// the most of host_lib_paths that's sent, which has to fit in an environment
+// variable; clients look for longer lists themselves
+#define ZYGOTE_MAX_LIBS (64 * 1024)
+
+#ifndef SYS_close_range
+#define SYS_close_range 436
+#endif
+
+static const long default_zygote_idle_secs = 300;
+
+// join the namespaces and root of a zygote, given "<mnt>,<root>,<user>" fds
+static void enter_zygote(const char *fds) {
+  int mntfd, rootfd, userfd;
+  errno = EINVAL;
+  die_if(sscanf(fds, "%d,%d,%d", &mntfd, &rootfd, &userfd) != 3,
+         "bad NIX_APPIMAGE_ZYGOTE_FDS '%s'", fds);
+
+  // joining a mount namespace moves us to its root, so save where we were
   char cwd[PATH_MAX];
   die_if(!getcwd(cwd, PATH_MAX), "cannot getcwd");
 
-  // chroot
-  die_if(chroot(mountroot) < 0, "cannot chroot %s", mountroot);
+  uint64_t start = trace_begin();
+  // the user namespace has to come first, it's what lets us join the other
+  die_if(userfd >= 0 && setns(userfd, CLONE_NEWUSER) < 0,
+         "cannot join the zygote's user namespace");
+  die_if(setns(mntfd, CLONE_NEWNS) < 0,
+         "cannot join the zygote's mount namespace");
+  trace_end("zygote-setns", start, NULL);
+
+  enter_root(rootfd, cwd);
+  close(mntfd);
+  close(rootfd);
+  if (userfd >= 0) {
+    close(userfd);
+  }
 
-  // cd back again
-  die_if(chdir(cwd) < 0, "cannot chdir %s", cwd);
+  // the daemon linked them into its root already
+  if (host_libs.len > 0) {
+    use_host_libs_dir();
+  }
+}
 
-  // Exec ----------------------------------------------------------------------
+static int send_zygote(int conn, const char *mountpoint, const int *fds,
+                       int nfds) {
+  // an empty list has the client look for itself
+  size_t libs_len = strlen(host_lib_paths) < ZYGOTE_MAX_LIBS
+                        ? strlen(host_lib_paths)
+                        : 0;
+  struct iovec iov[] = {
+      {.iov_base = (void *)mountpoint, .iov_len = strlen(mountpoint) + 1},
+      {.iov_base = (void *)host_lib_paths, .iov_len = libs_len},
+      {.iov_base = "", .iov_len = 1},
+  };
+  char control[CMSG_SPACE(3 * sizeof(int))];
+  memset(control, 0, sizeof(control));
+  struct msghdr msg = {
+      .msg_iov = iov,
+      .msg_iovlen = 3,
+      .msg_control = control,
+      .msg_controllen = CMSG_SPACE(nfds * sizeof(int)),
+  };
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+  return sendmsg(conn, &msg, MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
 
-  // For better error messages, we wanna get what entrypoint points to
-  char *entrypoint = strprintf("%s/entrypoint", appdir);
-  char exe[PATH_MAX + 1];
-  ssize_t exe_size = readlink(entrypoint, exe, PATH_MAX);
-  die_if(exe_size < 0, "cannot read link %s", entrypoint);
-  exe[exe_size] = 0;
-  free(entrypoint);
+// hand out the root to clients until there have been none for idle_secs
+static void serve_zygote(int listener, const char *mountpoint, const int *fds,
+                         int nfds, long idle_secs) {
+  struct pollfd polls[1 + ZYGOTE_MAX_CLIENTS];
+  nfds_t nclients = 0;
+  polls[0] = (struct pollfd){.fd = listener, .events = POLLIN};
+
+  while (true) {
+    int ready = poll(polls, 1 + nclients, nclients == 0 ? idle_secs * 1000 : -1);
+    if (ready == 0) {
+      return;
+    }
+    if (ready < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
 
-  execv(exe, argv);
-  die_if(true, "cannot exec %s", exe);
+    // clients never send anything, so any event means it's gone
+    for (nfds_t i = nclients; i >= 1; i--) {
+      if (polls[i].revents != 0) {
+        close(polls[i].fd);
+        polls[i] = polls[nclients--];
+      }
+    }
+
+    if (polls[0].revents & POLLIN) {
+      int conn = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+      if (conn < 0) {
+        continue;
+      }
+      struct ucred cred;
+      socklen_t len = sizeof(cred);
+      if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 ||
+          cred.uid != getuid() || nclients == ZYGOTE_MAX_CLIENTS ||
+          send_zygote(conn, mountpoint, fds, nfds) < 0) {
+        close(conn);
+        continue;
+      }
+      polls[++nclients] = (struct pollfd){.fd = conn, .events = POLLIN};
+    }
+  }
+}
+
+static int run_zygote(const char *socket_path, const char *image) {
+  // only one daemon per image
+  int lock = open(strprintf("%s.lock", socket_path),
+                  O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (lock < 0 || flock(lock, LOCK_EX | LOCK_NB) < 0) {
+    return 1;
+  }
+
+  const char *env = getenv("NIX_APPIMAGE_ZYGOTE_IDLE");
+  long idle_secs = env && env[0] ? strtol(env, NULL, 10) : default_zygote_idle_secs;
+  if (idle_secs <= 0 || idle_secs > INT_MAX / 1000) {
+    idle_secs = default_zygote_idle_secs;
+  }
+
+  // the image as our runtime mounted it goes away with the app, so the daemon
+  // needs a mount of its own
+  char *mountpoint = mount_appimage(image);
+  entrypoint = strprintf("%s%s", mountpoint, entrypoint + strlen(appdir));
+  appdir = mountpoint;
+  mountroot = strprintf("%s/mountroot", appdir);
+
+  uid_t uid = getuid();
+  gid_t gid = getgid();
+  extend_ld_library_path(NULL);
+  enter_namespaces(uid, gid);
+  prepare_root();
+
+  int fds[3];
+  int nfds = 0;
+  fds[nfds++] = open("/proc/self/ns/mnt", O_RDONLY | O_CLOEXEC);
+  fds[nfds++] = open(mountroot, O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (uid != 0) {
+    fds[nfds++] = open("/proc/self/ns/user", O_RDONLY | O_CLOEXEC);
+  }
+  for (int i = 0; i < nfds; i++) {
+    die_if(fds[i] < 0, "cannot open zygote fds");
+  }
+
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  die_if(strlen(socket_path) >= sizeof(addr.sun_path), "socket path too long");
+  strcpy(addr.sun_path, socket_path);
+  int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  die_if(listener < 0, "cannot create socket");
+  unlink(socket_path); // left behind by a daemon that died
+  die_if(bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+             listen(listener, 64) < 0,
+         "cannot listen on %s", socket_path);
+
+  serve_zygote(listener, mountpoint, fds, nfds, idle_secs);
+
+  // new clients fall back to mounting the image themselves from here on
+  unlink(socket_path);
+  return 0;
+}
+
+// close everything but stdin, stdout and stderr
+static void close_inherited_fds(void) {
+  if (syscall(SYS_close_range, 3, ~0U, 0) == 0) {
+    return;
+  }
+  // close_range() is Linux 5.9+
+  DIR *dir = opendir("/proc/self/fd");
+  if (!dir) {
+    return;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir))) {
+    int fd = atoi(entry->d_name);
+    if (fd > STDERR_FILENO && fd != dirfd(dir)) {
+      close(fd);
+    }
+  }
+  closedir(dir);
+}
+
+static void start_zygote(void) {
+  const char *env = getenv("NIX_APPIMAGE_ZYGOTE_SOCKET");
+  const char *image = getenv("APPIMAGE");
+  if (!env || env[0] != '/' || !image || image[0] != '/') {
+    return;
+  }
+  char *socket_path = strprintf("%s", env);
+  // the app shouldn't see this, nor pass it on to other images
+  unsetenv("NIX_APPIMAGE_ZYGOTE_SOCKET");
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    return;
+  }
+  if (pid > 0) {
+    waitpid(pid, NULL, 0);
+    return;
+  }
+
+  // like the run cache filler, reparented away from the app
+  if (fork() != 0) {
+    _exit(0);
+  }
+  setsid();
+  int null = open("/dev/null", O_RDWR | O_CLOEXEC);
+  if (null >= 0) {
+    dup2(null, STDIN_FILENO);
+    dup2(null, STDOUT_FILENO);
+    if (!ld_debug_enabled()) {
+      dup2(null, STDERR_FILENO);
+    }
+  }
+  trace_fd = -1;
+  // nothing of the app's launch should outlive it, like the runtime's end of
+  // its FUSE mount's keepalive pipe
+  close_inherited_fds();
+
+  _exit(run_zygote(socket_path, image));
+}
+
+void child_main(char **argv) {
+  // get uid, gid before going to new namespace
+  uid_t uid = getuid();
+  gid_t gid = getgid();
+
+  // the zygote looked for the host's libraries already
+  const char *zygote_fds = getenv("NIX_APPIMAGE_ZYGOTE_FDS");
+  const char *zygote_libs = getenv("NIX_APPIMAGE_ZYGOTE_LIBS");
+  extend_ld_library_path(zygote_fds && zygote_libs && zygote_libs[0]
+                             ? zygote_libs
+                             : NULL);
+  unsetenv("NIX_APPIMAGE_ZYGOTE_LIBS");
+
+  if (zygote_fds) {
+    char *fds = strprintf("%s", zygote_fds);
+    unsetenv("NIX_APPIMAGE_ZYGOTE_FDS");
+    enter_zygote(fds);
+    exec_entrypoint(argv);
+  }
+
+  if (host_store_enabled()) {
+    uint64_t start = trace_begin();
+    bool on_host = closure_on_host();
+    trace_end("host-store", start, ",\"present\":%s", on_host ? "true" : "false");
+    if (on_host) {
+      exec_entrypoint(argv);
+    }
+  }
+
+  // the image's files are only needed from here on
+  start_prefetch();
+
+  enter_namespaces(uid, gid);
+
+  if (nix_only_requested()) {
+    uint64_t start = trace_begin();
+    const char *mode = mount_nix_only();
+    trace_end("nix-only", start, ",\"mode\":\"%s\"", mode ? mode : "none");
+    if (mode) {
+      exec_entrypoint(argv);
+    }
+  }
+
+  prepare_root();
+
+  // save where we were so we can cd into it
+  char cwd[PATH_MAX];
+  die_if(!getcwd(cwd, PATH_MAX), "cannot getcwd");
+
+  int rootfd = open(mountroot, O_PATH | O_DIRECTORY | O_CLOEXEC);
+  die_if(rootfd < 0, "cannot open %s", mountroot);
+  enter_root(rootfd, cwd);
+  close(rootfd);
+
+  exec_entrypoint(argv);
 }
 
 int main(int argc, char **argv) {
   argv0 = argv[0];
+  trace_open();
+  trace_end("start", trace_begin(), NULL);
 
   // get location of exe
   char appdir_buf[PATH_MAX];
@@ -697,6 +2918,13 @@ int main(int argc, char **argv) {
   // inside the squashfs, we don't need to remove this dir later (which we
   // would have had to do if using mktemp)!
   mountroot = strprintf("%s/mountroot", appdir);
+  entrypoint = select_entrypoint();
+  if (ld_debug_enabled()) {
+    fprintf(stderr, "%s: entrypoint %s\n", argv0, entrypoint);
+  }
+
+  start_run_cache_fill();
+  start_zygote();
 
   child_main(argv);
 }
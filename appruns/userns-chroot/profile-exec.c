@@ -0,0 +1,19 @@
+// Linked into the instrumented build of the PGO variant (see lto.nix) with
+// -Wl,--wrap=execv. A profiled program writes its profile when it exits,
+// which AppRun never does when the exec succeeds, so write it first. Keeping
+// this out of main.c keeps it the same code in both builds, as -fprofile-use
+// requires.
+
+#include <unistd.h>
+
+void __gcov_dump(void);
+void __gcov_reset(void);
+int __real_execv(const char *path, char *const argv[]);
+
+int __wrap_execv(const char *path, char *const argv[]) {
+  __gcov_dump();
+  int ret = __real_execv(path, argv);
+  // still running, so the counts from here on are added at exit as usual
+  __gcov_reset();
+  return ret;
+}
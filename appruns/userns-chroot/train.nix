@@ -0,0 +1,30 @@
+{ writeShellApplication
+, coreutils
+
+  # passed from flake.nix
+, bench-startup # the startup benchmark, with only the instrumented AppRun
+}:
+
+# Records the profile lto.nix optimizes AppRun with, by running the startup
+# benchmark with the instrumented build, on the host, where AppRun can mount
+# images and set up namespaces as it does for users.
+writeShellApplication {
+  name = "train-apprun";
+  runtimeInputs = [ coreutils bench-startup ];
+  text = ''
+    if [ $# -gt 0 ] && [ "''${1#-}" = "$1" ]; then
+      out=$1
+      shift
+    else
+      out=appruns/userns-chroot/profile
+    fi
+    mkdir -p "$out"
+    out=$(realpath "$out")
+    results=$(mktemp)
+    trap 'rm -f "$results"' EXIT
+
+    # the counts of every run are added to the .gcda files already there
+    GCOV_PREFIX=$out GCOV_PREFIX_STRIP=1 bench-startup --output "$results" "$@"
+    echo "profile written to $out; with it checked in, packages.<system>.appimage-appruns.userns-chroot-lto is built with it"
+  '';
+}
@@ -0,0 +1,54 @@
+{ lib
+, writeShellApplication
+, writeText
+, coreutils
+, gawk
+, jq
+, util-linux
+, hello
+, python3
+
+  # passed from flake.nix
+, mkAppImageWith # runtime: apprun: a mkAppImage using that runtime and apprun
+, runtimes # attrset of runtimes to benchmark
+, appruns # attrset of appruns to benchmark
+, squashfsArgs ? [ ]
+}:
+
+let
+  # what to bundle, and the arguments it's started with
+  programs = {
+    hello = { program = lib.getExe hello; args = [ ]; };
+    # a much larger closure, which opens a few hundred files on startup
+    python3 = { program = lib.getExe python3; args = [ "-c" "import json, sqlite3, ssl" ]; };
+  };
+
+  # every program, bundled with every runtime, apprun and compression profile
+  cases = map
+    ({ name, runtime, apprun, compression }: {
+      inherit name runtime apprun compression;
+      inherit (programs.${name}) args;
+      image = (mkAppImageWith runtimes.${runtime} appruns.${apprun}) {
+        inherit (programs.${name}) program;
+        inherit squashfsArgs;
+        compression = if compression == "default" then null else compression;
+        name = "${name}-${runtime}-${apprun}-${compression}.AppImage";
+      };
+    })
+    (lib.cartesianProduct {
+      name = lib.attrNames programs;
+      runtime = lib.attrNames runtimes;
+      apprun = lib.attrNames appruns;
+      # "default" is mksquashfs' own, what images get without a profile
+      compression = [ "default" ] ++ lib.attrNames (import ../compression.nix);
+    });
+
+  manifest = writeText "bench-startup.json" (builtins.toJSON cases);
+in
+writeShellApplication {
+  name = "bench-startup";
+  runtimeInputs = [ coreutils gawk jq util-linux ];
+  text = ''
+    BENCH_MANIFEST=''${BENCH_MANIFEST:-${manifest}}
+  '' + builtins.readFile ./startup.sh;
+}
@@ -0,0 +1,255 @@
+# shellcheck shell=bash
+# Startup latency benchmark for nix-appimage.
+#
+# Runs every image listed in $BENCH_MANIFEST (built by ./default.nix) a number
+# of times, with a cold and a warm page cache, and reports percentiles of the
+# wall time along with the per-phase timings from AppRun's NIX_APPIMAGE_TRACE.
+# Every image is built with mksquashfs' defaults ("default") and with each
+# compression profile, and the fastest of those for each program, runtime and
+# apprun is reported at the end, followed by how the appruns compare with each
+# other.
+
+usage() {
+	cat <<USAGE
+Usage: bench-startup [OPTIONS]
+
+Options:
+  -n, --runs N         runs per image and mode (default: $runs)
+  -m, --mode MODES     space-separated modes to run, out of "cold warm"
+                       (default: "$modes")
+  -f, --filter STR     only run cases whose name contains STR
+  -o, --output FILE    write results as JSON to FILE (default: $output)
+  -b, --baseline FILE  compare against the results of an earlier run, and
+                       exit with status 1 if any case regressed
+  -t, --threshold PCT  allowed slowdown relative to the baseline (default: $threshold)
+  -s, --stat STAT      statistic compared against the baseline, one of
+                       p50, p95, p99 (default: $stat)
+
+Cold runs drop the image from the page cache (dd iflag=nocache) and start
+with an empty \$XDG_CACHE_HOME before every run; warm runs do one untimed run
+first and share a cache directory.
+USAGE
+}
+
+runs=20
+modes="cold warm"
+filter=
+output=bench-startup.json
+baseline=
+threshold=10
+stat=p50
+
+while [ $# -gt 0 ]; do
+	case "$1" in
+	-n | --runs) runs=$2; shift 2 ;;
+	-m | --mode) modes=$2; shift 2 ;;
+	-f | --filter) filter=$2; shift 2 ;;
+	-o | --output) output=$2; shift 2 ;;
+	-b | --baseline) baseline=$2; shift 2 ;;
+	-t | --threshold) threshold=$2; shift 2 ;;
+	-s | --stat) stat=$2; shift 2 ;;
+	-h | --help) usage; exit 0 ;;
+	*) usage >&2; exit 2 ;;
+	esac
+done
+
+# EPOCHREALTIME uses the locale's decimal separator
+export LC_ALL=C
+
+workdir=$(mktemp -d)
+trap 'rm -rf "$workdir"' EXIT
+samples=$workdir/samples.tsv
+sizes=$workdir/sizes.tsv
+: >"$samples"
+: >"$sizes"
+
+# record the wall time and the trace of one run as "case mode metric usecs"
+run_once() {
+	local case=$1 mode=$2 image=$3
+	shift 3
+
+	local trace=$workdir/trace
+	: >"$trace"
+	if [ "$mode" = cold ]; then
+		dd if="$image" iflag=nocache count=0 status=none
+		rm -rf "$workdir/cache-cold"
+		export XDG_CACHE_HOME=$workdir/cache-cold
+	else
+		export XDG_CACHE_HOME=$workdir/cache-warm
+	fi
+
+	local start end status
+	start=${EPOCHREALTIME/./}
+	NIX_APPIMAGE_TRACE=$trace "$image" "$@" >/dev/null 2>"$workdir/stderr" || {
+		status=$?
+		echo "$case: $image exited with status $status:" >&2
+		cat "$workdir/stderr" >&2
+		return 1
+	}
+	end=${EPOCHREALTIME/./}
+
+	printf '%s\t%s\twall\t%s\n' "$case" "$mode" "$((end - start))" >>"$samples"
+
+	# phase durations, plus how long AppRun took from starting to exec
+	jq -r --arg case "$case" --arg mode "$mode" --slurp '
+		map(select(.source == "apprun")) as $events
+		| ($events | group_by(.phase)[]
+			| [$case, $mode, "phase:" + .[0].phase,
+			   (map(.end_ns - .start_ns) | add / 1000 | floor)])
+		, ($events
+			| (map(select(.phase == "exec"))[0].end_ns) as $exec
+			| (map(select(.phase == "start"))[0].start_ns) as $start
+			| select($exec != null and $start != null)
+			| [$case, $mode, "apprun-to-exec", (($exec - $start) / 1000 | floor)])
+		| @tsv
+	' "$trace" >>"$samples"
+}
+
+count=$(jq length "$BENCH_MANIFEST")
+for ((i = 0; i < count; i++)); do
+	case=$(jq -r ".[$i] | \"\(.name)/\(.runtime)/\(.apprun)/\(.compression)\"" "$BENCH_MANIFEST")
+	if [ -n "$filter" ] && [[ $case != *"$filter"* ]]; then
+		continue
+	fi
+	image=$(jq -r ".[$i].image" "$BENCH_MANIFEST")
+	mapfile -t args < <(jq -r ".[$i].args[]" "$BENCH_MANIFEST")
+	printf '%s\t%s\n' "$case" "$(stat -L -c %s "$image")" >>"$sizes"
+
+	for mode in $modes; do
+		echo "running $case ($mode, $runs runs)" >&2
+		if [ "$mode" = warm ]; then
+			# populate the page cache and AppRun's caches
+			run_once "$case" warmup "$image" "${args[@]}"
+		fi
+		for ((run = 0; run < runs; run++)); do
+			run_once "$case" "$mode" "$image" "${args[@]}"
+		done
+	done
+done
+
+# nearest-rank percentiles for each case, mode and metric, in milliseconds
+grep -v '	warmup	' "$samples" |
+	sort -t '	' -k1,1 -k2,2 -k3,3 -k4,4n |
+	awk -F '\t' -v OFS='\t' '
+		function flush() {
+			if (n == 0) return
+			print key[1], key[2], key[3], n, pct(0.50), pct(0.95), pct(0.99)
+		}
+		function pct(q,    i) {
+			i = int(q * n)
+			if (i < q * n) i++
+			if (i < 1) i = 1
+			return sprintf("%.3f", v[i] / 1000)
+		}
+		$1 "\t" $2 "\t" $3 != cur {
+			flush()
+			cur = $1 "\t" $2 "\t" $3
+			split(cur, key, "\t")
+			n = 0
+		}
+		{ v[++n] = $4 }
+		END { flush() }
+	' >"$workdir/stats.tsv"
+
+jq -R -n '[inputs | split("\t") | {
+	case: .[0], mode: .[1], metric: .[2], runs: (.[3] | tonumber),
+	p50: (.[4] | tonumber), p95: (.[5] | tonumber), p99: (.[6] | tonumber)
+}]' "$workdir/stats.tsv" >"$output"
+
+{
+	printf '%s\t%s\t%s\t%s\t%s\t%s\n' case mode metric p50_ms p95_ms p99_ms
+	awk -F '\t' -v OFS='\t' '{ print $1, $2, $3, $5, $6, $7 }' "$workdir/stats.tsv"
+} | column -t -s '	'
+
+# the compression profile (the last part of the case) with the lowest p50 wall
+# time, for each program, runtime, apprun and mode
+echo
+awk -F '\t' -v OFS='\t' '
+	FNR == NR { size[$1] = $2; next }
+	$3 != "wall" { next }
+	{
+		group = $1
+		sub("/[^/]*$", "", group)
+		profile = substr($1, length(group) + 2)
+		key = group "\t" $2
+		if (!(key in best) || $5 < best_p50[key]) {
+			best[key] = profile
+			best_p50[key] = $5
+			best_size[key] = size[$1]
+		}
+	}
+	END {
+		print "case", "mode", "fastest_profile", "p50_ms", "size_mib"
+		for (key in best)
+			print key, best[key], best_p50[key], sprintf("%.1f", best_size[key] / 1048576)
+	}
+' "$sizes" "$workdir/stats.tsv" | {
+	read -r header
+	echo "$header"
+	sort
+} | column -t -s '	'
+
+# each apprun (the third part of the case) next to the others, for the same
+# program, runtime, profile and mode, relative to the first of them
+echo
+awk -F '\t' -v OFS='\t' '
+	$3 != "wall" && $3 != "apprun-to-exec" { next }
+	{
+		split($1, part, "/")
+		key = part[1] "/" part[2] "/" part[4] "\t" $2
+		if (!((key, part[3]) in seen)) {
+			seen[key, part[3]] = 1
+			appruns[key] = appruns[key] " " part[3]
+		}
+		p50[key, part[3], $3] = $5
+	}
+	END {
+		print "case", "mode", "apprun", "wall_p50_ms", "vs_first", "apprun_to_exec_p50_ms"
+		for (key in appruns) {
+			n = split(appruns[key], names, " ")
+			if (n < 2) continue
+			first = p50[key, names[1], "wall"]
+			for (i = 1; i <= n; i++) {
+				wall = p50[key, names[i], "wall"]
+				print key, names[i], wall,
+					(first > 0 ? sprintf("%+.1f%%", (wall / first - 1) * 100) : "-"),
+					p50[key, names[i], "apprun-to-exec"]
+			}
+		}
+	}
+' "$workdir/stats.tsv" | {
+	read -r header
+	echo "$header"
+	sort
+} | column -t -s '	'
+echo "results written to $output" >&2
+
+if [ -z "$baseline" ]; then
+	exit 0
+fi
+
+# a case regresses when its wall time grew by more than the threshold; the
+# phases that grew the most are listed to point at the cause
+regressions=$(jq -r -n --slurpfile old "$baseline" --slurpfile new "$output" \
+	--arg stat "$stat" --argjson threshold "$threshold" '
+	($old[0] | map({key: "\(.case) \(.mode) \(.metric)", value: .[$stat]}) | from_entries) as $base
+	| $new[0]
+	| map(select(.metric == "wall"))[]
+	| . as $cur
+	| $base["\(.case) \(.mode) wall"] as $was
+	| select($was != null and $was > 0 and $cur[$stat] > $was * (1 + $threshold / 100))
+	| "\(.case) (\(.mode)): \($stat) \($was) ms -> \($cur[$stat]) ms"
+	, ($new[0]
+		| map(select(.case == $cur.case and .mode == $cur.mode and (.metric | startswith("phase:"))))
+		| map(. as $p | {metric, delta: ($p[$stat] - ($base["\($p.case) \($p.mode) \($p.metric)"] // 0))})
+		| sort_by(-.delta)[:3][]
+		| select(.delta > 0)
+		| "    \(.metric | ltrimstr("phase:")): +\(.delta * 1000 | round / 1000) ms")
+')
+
+if [ -n "$regressions" ]; then
+	echo "regressions over ${threshold}% against $baseline:" >&2
+	echo "$regressions" >&2
+	exit 1
+fi
+echo "no regressions over ${threshold}% against $baseline" >&2
@@ -0,0 +1,13 @@
+# Named compression profiles for mkAppImage's `compression` argument, as
+# mksquashfs arguments. Every runtime in ./runtimes can read all of these.
+{
+  # lz4 decompresses several times faster than zstd, and small blocks mean
+  # less to decompress for each small read; -Xhc costs build time only
+  fast-start = [ "-comp" "lz4" "-Xhc" "-b" "64K" ];
+
+  # about the size of mksquashfs' default gzip, but much faster to read
+  balanced = [ "-comp" "zstd" "-Xcompression-level" "15" "-b" "128K" ];
+
+  # zstd rather than xz, which is only slightly smaller but far slower to read
+  smallest = [ "-comp" "zstd" "-Xcompression-level" "19" "-b" "1M" ];
+}
@@ -15,6 +15,20 @@
     flake-utils.lib.eachDefaultSystem (system:
       let
         pkgs = (import nixpkgs { inherit system; }).pkgsStatic;
+
+        # a mkAppImage using a specific runtime and apprun
+        mkAppImageWith = runtime: apprun: pkgs.callPackage ./mkAppImage.nix {
+          mkappimage-runtime = runtime;
+          mkappimage-apprun = apprun;
+        };
+
+        # Exclude files matching the wildcard patterns in ./excludelist. A leading
+        # "..." makes a pattern non-anchored, so it matches anywhere in the tree.
+        excludelistArgs = pkgs.lib.map pkgs.lib.escapeShellArg [
+          "-wildcards"
+          "-ef"
+          "${./excludelist}"
+        ];
       in
       rec {
         # runtimes are an executable that mount the squashfs part of the appimage and start AppRun
@@ -23,39 +37,113 @@
           appimage-type2-runtime = pkgs.callPackage ./runtimes/appimage-type2-runtime { };
         };
 
+        # starts an AppImage from a URL, downloading only what it reads, see
+        # runtimes/appimage-stream-runtime/stream.c
+        packages.appimage-stream-runtime = pkgs.callPackage ./runtimes/appimage-stream-runtime {
+          inherit (packages.appimage-runtimes) appimage-type2-runtime;
+        };
+
+        apps.stream = {
+          type = "app";
+          program = "${packages.appimage-stream-runtime}";
+        };
+
         # appruns contain an AppRun executable that does setup and launches entrypoint
         packages.appimage-appruns = {
           userns-chroot = pkgs.callPackage ./appruns/userns-chroot { };
+          # the same as a static-pie built with LTO, and with the profile recorded by
+          # train-apprun when one is checked in, see appruns/userns-chroot/lto.nix
+          userns-chroot-lto = pkgs.callPackage ./appruns/userns-chroot/lto.nix {
+            profile =
+              if builtins.pathExists ./appruns/userns-chroot/profile
+              then ./appruns/userns-chroot/profile else null;
+          };
         };
 
-        lib.mkAppImage = pkgs.callPackage ./mkAppImage.nix {
+        # userns-chroot-lto instrumented to record a profile, kept out of appimage-appruns
+        # so the benchmark doesn't time it
+        packages.userns-chroot-instrumented =
+          packages.appimage-appruns.userns-chroot-lto.instrumented;
+
+        lib.mkAppImage = mkAppImageWith
+          packages.appimage-runtimes.appimage-type2-runtime
+          packages.appimage-appruns.userns-chroot;
+
+        # a base layer that images built with `base = ...` share, see mkBaseLayer.nix
+        lib.mkBaseLayer = pkgs.callPackage ./mkBaseLayer.nix {
           mkappimage-runtime = packages.appimage-runtimes.appimage-type2-runtime;
-          mkappimage-apprun = packages.appimage-appruns.userns-chroot;
         };
 
-        bundlers.default = drv:
-          if drv.type == "app" then
-            lib.mkAppImage
-              {
-                program = drv.program;
-                          squashfsArgs = pkgs.lib.map pkgs.lib.escapeShellArg [
-              "-wildcards"
-              "-ef" "${./excludelist}"
-            ];
-
-              }
-          else if drv.type == "derivation" then
-            lib.mkAppImage
-              {
-                program = pkgs.lib.getExe drv;
-                # Exclude files which match the wildcard pattern "*.gz" anywhere within DIRECTORY and its sub-directories. The initial "..." indicates the wildcard pattern is "non-anchored" and will match anywhere.
-                          squashfsArgs = pkgs.lib.map pkgs.lib.escapeShellArg [
-              "-wildcards"
-              "-ef" "${./excludelist}"
-            ];
-
-              }
-          else builtins.abort "don't know how to build ${drv.type}; only know app and derivation";
+        # startup latency of every runtime x apprun combination, see bench/startup.sh
+        packages.bench-startup = (import nixpkgs { inherit system; }).callPackage ./bench {
+          inherit mkAppImageWith;
+          runtimes = packages.appimage-runtimes;
+          appruns = packages.appimage-appruns;
+          squashfsArgs = excludelistArgs;
+        };
+
+        apps.bench-startup = {
+          type = "app";
+          program = "${packages.bench-startup}/bin/bench-startup";
+        };
+
+        # records the profile for userns-chroot-lto, see appruns/userns-chroot/train.nix
+        packages.train-apprun = (import nixpkgs { inherit system; }).callPackage ./appruns/userns-chroot/train.nix {
+          bench-startup = (import nixpkgs { inherit system; }).callPackage ./bench {
+            inherit mkAppImageWith;
+            runtimes = { inherit (packages.appimage-runtimes) appimage-type2-runtime; };
+            appruns = { instrumented = packages.userns-chroot-instrumented; };
+            squashfsArgs = excludelistArgs;
+          };
+        };
+
+        apps.train-apprun = {
+          type = "app";
+          program = "${packages.train-apprun}/bin/train-apprun";
+        };
+
+        # records the files an AppImage uses at startup, for mkAppImage's startupProfile
+        packages.profile-startup = (import nixpkgs { inherit system; }).callPackage ./profile { };
+
+        apps.profile-startup = {
+          type = "app";
+          program = "${packages.profile-startup}/bin/profile-startup";
+        };
+
+        # updates an AppImage built with updateInformation in place, see update/update.sh
+        packages.update = (import nixpkgs { inherit system; }).callPackage ./update { };
+
+        apps.update = {
+          type = "app";
+          program = "${packages.update}/bin/update";
+        };
+
+        # `nix bundle --bundler .#<profile>` picks one of the compression
+        # profiles in ./compression.nix; the default bundler keeps mksquashfs' own
+        bundlers =
+          let
+            mkBundler = args: drv:
+              if drv.type == "app" then
+                lib.mkAppImage
+                  ({
+                    program = drv.program;
+                    # not part of the app schema, but ./bundle passes it for multi-program images
+                    programs = drv.programs or { };
+                    squashfsArgs = excludelistArgs;
+                  } // args)
+              else if drv.type == "derivation" then
+                lib.mkAppImage
+                  ({
+                    program = pkgs.lib.getExe drv;
+                    squashfsArgs = excludelistArgs;
+                  } // args)
+              else builtins.abort "don't know how to build ${drv.type}; only know app and derivation";
+          in
+          {
+            default = mkBundler { };
+          } // pkgs.lib.mapAttrs
+            (compression: _: mkBundler { inherit compression; })
+            (import ./compression.nix);
 
         checks =
           let
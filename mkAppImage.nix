@@ -1,6 +1,10 @@
 { lib
 , runCommand
+, patchelf
 , squashfsTools
+, jq
+, binutils-unwrapped
+, zsync
 , writeTextFile
 
   # mkappimage-specific, passed from flake.nix
@@ -10,89 +14,206 @@
 
 # actual arguments
 { program # absolute path of executable to start
+, programs ? { } # more executables, by name, started instead when the image is run as that name (e.g. through a symlink)
 
   # output name
 , pname ? (lib.last (builtins.split "/" program))
 , name ? "${pname}.AppImage"
 
   # advanced appimage configuration
+, compression ? null # one of the profiles in ./compression.nix, or null for mksquashfs' defaults
+, uncompressed ? [ # with a compression profile, file name patterns to store without compression, since they're compressed already
+    "*.jar" "*.zip" "*.whl" "*.gz" "*.tgz" "*.xz" "*.bz2" "*.zst" "*.lz4"
+    "*.png" "*.jpg" "*.jpeg" "*.gif" "*.webp" "*.woff2" "*.ogg" "*.mp3" "*.mp4"
+  ]
 , squashfsArgs ? [ ] # additional arguments to pass to mksquashfs
+, prune ? false # leave out libraries nothing loads, and docs, headers and static libraries
+, pruneLocales ? false # with prune, leave out translations (share/locale) too
+, pruneKeep ? [ ] # globs for files to keep anyway, e.g. dlopen()ed libraries like "*/lib/libvulkan.so*"
+, base ? null # a layer from mkBaseLayer, whose store paths are left out of this image
+, startupProfile ? null # store paths in the order they're used at startup (and how many bytes), from `nix run .#profile-startup`
+, hostLibs ? null # host libraries (file name globs) to put on LD_LIBRARY_PATH, or null for every host library directory
+, updateInformation ? null # where to fetch updates from, e.g. "zsync|https://example.com/hello.AppImage.zsync", see `nix run .#update`
 }:
 
 let
+  compressionProfiles = import ./compression.nix;
+
+  compressionArgs = lib.optionals (compression != null) (
+    compressionProfiles.${compression} or (throw
+      "mkAppImage: unknown compression profile '${compression}', expected one of: ${lib.concatStringsSep ", " (lib.attrNames compressionProfiles)}")
+  ) ++ lib.optionals (compression != null && uncompressed != [ ]) [
+    # mksquashfs already stores blocks raw when they don't shrink at all, this
+    # also catches the ones that barely do, which would still cost a
+    # decompression on every read
+    "-action"
+    (lib.escapeShellArg "uncompressed@${lib.concatMapStringsSep " || " (p: "name(${p})") uncompressed}")
+  ];
+
   commonArgs = [
     "-offset $(stat -L -c%s ${lib.escapeShellArg mkappimage-runtime})" # squashfs comes after the runtime
     "-all-root" # chown to root
   ] ++ squashfsArgs;
 
-  # Workaround for writeClosure bug.
-  #
-  # Due to a bug in Nix, writeClosure with a path *under* a nix store path (e.g.
-  # /nix/store/...-hello/bin/hello) raises the error "path '$program' is not in
-  # the Nix store".
-  #
-  # See: https://github.com/ralismark/nix-appimage/issues/16
-  # See: https://github.com/NixOS/nixpkgs/issues/316652
-  # See: https://github.com/NixOS/nix/pull/10549
-  #
-  # This should be fixed in the latest version of Nix, however version where
-  # this bug is present are still common, so we work around it by using the old
-  # implementation of writeReferencesToFile from
-  # https://github.com/NixOS/nixpkgs/blob/e99021ff754a204e38df619ac908ac92885636a4/pkgs/build-support/trivial-builders/default.nix#L628-L640
-  writeReferencesToFile = path: runCommand "runtime-deps"
-    {
-      exportReferencesGraph = [ "graph" path ];
-    }
-    ''
-      touch $out
-      while read path; do
-        echo $path >> $out
-        read dummy
-        read nrRefs
-        for ((i = 0; i < nrRefs; i++)); do read ref; done
-      done < graph
+  # the list of store paths in the closure of a path
+  writeReferencesToFile = import ./write-references.nix { inherit runCommand; };
+
+  # store paths needed to run program, also embedded in the image as `closure`
+  # so AppRun can tell whether the host store already has all of them
+  closure = writeReferencesToFile (
+    if programs == { } then program
+    else
+      writeTextFile {
+        name = "${pname}-entrypoints";
+        text = lib.concatMapStrings (path: "${path}\n") ([ program ] ++ lib.attrValues programs);
+      }
+  );
+
+  # the store paths that go in the image itself
+  imagePaths =
+    if base == null then closure
+    else runCommand "image-paths" { } ''
+      # the rest are found in the base layer at runtime
+      grep -vxF -f ${base.closure} ${closure} > $out || true
     '';
+
+  # zsync's control file for the image, to be published next to it at the URL
+  # in updateInformation. Only the blocks that changed are then downloaded,
+  # the rest is copied from the old image.
+  mkZsync = image: runCommand "${name}.zsync"
+    {
+      nativeBuildInputs = [ zsync ];
+    } ''
+    zsyncmake -u ${lib.escapeShellArg name} -o $out ${image}
+  '';
+
+  # what each store path in the closure adds to the image, and reads at
+  # startup, as report.json and report.txt; see ./report.sh
+  mkReport = image: runCommand "${name}-report"
+    {
+      nativeBuildInputs = [ squashfsTools jq ];
+      # the closure has to be in the sandbox, to compare with what's in the image
+      entrypoints = [ program ] ++ lib.attrValues programs;
+    } ''
+    bash ${./report.sh} $out ${image} "$(stat -L -c%s ${lib.escapeShellArg mkappimage-runtime})" ${closure} \
+      ${builtins.concatStringsSep " " compressionArgs}
+  '';
+
+  image = runCommand name
+    {
+      nativeBuildInputs = [
+        squashfsTools
+        patchelf
+      ]
+      ++ lib.optional (updateInformation != null) binutils-unwrapped;
+
+      passthru = {
+        report = mkReport image;
+      } // lib.optionalAttrs (updateInformation != null) {
+        zsync = mkZsync image;
+      };
+    } ''
+    set -x
+    for entrypoint in ${lib.escapeShellArgs ([ program ] ++ lib.attrValues programs)}; do
+      if ! test -x "$entrypoint"; then
+        echo "entrypoint '$entrypoint' is not executable"
+        exit 1
+      fi
+    done
+
+    ${./extra-files.sh} ${program}
+    cp ${closure} extras/closure
+    # the entrypoints' ld.so that take --argv0 (glibc 2.33+), which AppRun can
+    # start them through with NIX_APPIMAGE_EXEC_THROUGH_LD=1; an ld.so for
+    # another platform doesn't run here, and isn't listed
+    for entrypoint in ${lib.escapeShellArgs ([ program ] ++ lib.attrValues programs)}; do
+      if interp=$(patchelf --print-interpreter "$(readlink -f "$entrypoint")" 2>/dev/null) &&
+        version=$("$interp" --version 2>/dev/null) &&
+        grep -qE '^ld\.so .* version 2\.(3[3-9]|[4-9][0-9])' <<<"$version"; then
+        echo "$interp"
+      fi
+    done | sort -u > extras/interp-argv0
+    if ! [ -s extras/interp-argv0 ]; then
+      rm extras/interp-argv0
+    fi
+    ${lib.optionalString (hostLibs != null) ''
+      printf '%s\n' ${lib.escapeShellArgs hostLibs} > extras/host-libs
+    ''}
+    ${lib.optionalString (base != null) ''
+      echo ${lib.escapeShellArg (baseNameOf "${base}")} > extras/base
+    ''}
+    ${lib.optionalString (startupProfile != null) ''
+      # the first file used at startup gets the highest priority, so files are
+      # laid out in the order they're needed; mksquashfs keys priorities by
+      # inode, so symlinks are resolved first
+      while read -r path bytes; do
+        if real=$(readlink -e "$path") && [ -f "$real" ]; then
+          echo "$real ''${bytes:-0}"
+        fi
+      done < ${startupProfile} \
+        | awk 'NF == 2 && !seen[$1]++' > startup-files
+      awk 'n < 32767 { print $1, 32767 - n++ }' startup-files > startup.sort
+      # AppRun reads these into the page cache while it sets up, see main.c
+      cp startup-files extras/startup-files
+    ''}
+
+    ${lib.optionalString prune ''
+      PRUNE_LOCALES=${if pruneLocales then "1" else "0"} bash ${./prune-closure.sh} ${program} ${imagePaths} ${lib.escapeShellArgs (pruneKeep ++ lib.attrValues programs)} > prune-excludes
+    ''}
+
+    # everything outside the store is added as pseudo files, so that the whole
+    # image is written by a single mksquashfs run
+    ${./pseudo-files.sh} ${mkappimage-apprun} extras > pseudo-files
+
+    mksquashfs ${builtins.concatStringsSep " " ([
+      "$(cat ${imagePaths})"
+      "$out"
+
+      # additional files
+      (lib.concatMapStrings (x: " -p ${lib.escapeShellArg x}") ([
+        # symlink entrypoint to the executable to run
+        "entrypoint s 555 0 0 ${program}"
+      ] ++ lib.optionals (programs != { }) ([
+        # and to the ones picked by the name the image is run as
+        "entrypoints d 555 0 0"
+      ] ++ lib.mapAttrsToList
+        (entry: path:
+          assert lib.assertMsg (builtins.match "[^/]+" entry != null && entry != "." && entry != "..")
+            "mkAppImage: bad entrypoint name '${entry}'";
+          "entrypoints/${entry} s 555 0 0 ${path}")
+        programs)))
+      "-pf pseudo-files" # the apprun, and .DirIcon, closure etc. from extras
+
+      "-no-strip" # don't strip leading dirs, to preserve the fact that everything's in the nix store
+    ] ++ compressionArgs
+    ++ lib.optionals prune [
+      "-wildcards"
+      "-ef prune-excludes"
+    ] ++ lib.optionals (startupProfile != null) [
+      "-sort startup.sort" # startup files first, and sharing fragment blocks
+    ] ++ commonArgs)}
+
+    # fill in the space left by -offset with the runtime, without touching the
+    # rest of the image
+    dd if=${lib.escapeShellArg mkappimage-runtime} of=$out conv=notrunc
+    ${lib.optionalString (updateInformation != null) ''
+      # the runtime reserves the .upd_info section for this, for updaters to read
+      read -r offset size < <(readelf -S -W $out \
+        | sed -nE 's/.*\.upd_info +[A-Z_]+ +[0-9a-f]+ +([0-9a-f]+) +([0-9a-f]+).*/\1 \2/p') || true
+      if [ -z "''${offset:-}" ]; then
+        echo "the runtime has no .upd_info section to put updateInformation in"
+        exit 1
+      fi
+      info=${lib.escapeShellArg updateInformation}
+      if [ ''${#info} -ge $((16#$size)) ]; then
+        echo "updateInformation is longer than the $((16#$size)) bytes the runtime reserves"
+        exit 1
+      fi
+      printf '%s' "$info" | dd of=$out bs=1 seek=$((16#$offset)) conv=notrunc
+    ''}
+
+    # make executable
+    chmod 755 $out
+  '';
 in
-runCommand name
-{
-  nativeBuildInputs = [
-    squashfsTools
-  ];
-} ''
-  set -x
-  if ! test -x ${program}; then
-    echo "entrypoint '${program}' is not executable"
-    exit 1
-  fi
-
-  ${./extra-files.sh} ${program}
-
-  mksquashfs ${builtins.concatStringsSep " " ([
-    # first run of mksquashfs copies the nix/store closure and additional files
-    "$(cat ${writeReferencesToFile program})"
-    "$out"
-
-    # additional files
-    (lib.concatMapStrings (x: " -p ${lib.escapeShellArg x}") [
-      # symlink entrypoint to the executable to run
-      "entrypoint s 555 0 0 ${program}"
-    ])
-
-    "-no-strip" # don't strip leading dirs, to preserve the fact that everything's in the nix store
-  ] ++ commonArgs)}
-
-  mksquashfs ${builtins.concatStringsSep " " ([
-    # second run of mksquashfs adds the apprun
-    # no -no-strip since we *do* want to strip leading dirs now
-    "${mkappimage-apprun}/*"
-    "$(find extras -mindepth 1 -maxdepth 1)" # to include .DirIcon
-    "$out"
-    "-no-recovery" # i don't know what a recovery file is but it gives "No such file or directory"
-  ] ++ commonArgs)}
-
-  # add the runtime to the start
-  dd if=${lib.escapeShellArg mkappimage-runtime} of=$out conv=notrunc
-
-  # make executable
-  chmod 755 $out
-''
+image
@@ -0,0 +1,53 @@
+{ lib
+, runCommand
+, squashfsTools
+, writeText
+
+  # mkappimage-specific, passed from flake.nix
+, mkappimage-runtime # lets AppRun mount the layer with --appimage-mount
+}:
+
+# actual arguments
+{ paths # store paths whose closures go in the layer, e.g. [ pkgs.glibc pkgs.openssl ]
+
+  # output name
+, name ? "nix-appimage-base"
+
+  # advanced configuration, as for mkAppImage
+, compression ? null
+, squashfsArgs ? [ ]
+}:
+
+let
+  writeReferencesToFile = import ./write-references.nix { inherit runCommand; };
+
+  # closure of all of paths at once
+  closure = writeReferencesToFile
+    (writeText "${name}-paths" (lib.concatMapStrings (path: "${path}\n") paths));
+in
+runCommand "${name}.AppImage"
+{
+  nativeBuildInputs = [
+    squashfsTools
+  ];
+
+  # mkAppImage leaves these paths out of images built on this layer
+  passthru = { inherit closure; };
+} ''
+  set -x
+
+  # like an AppImage, minus the AppRun, since it's only ever mounted
+  mksquashfs ${builtins.concatStringsSep " " ([
+    "$(cat ${closure})"
+    "$out"
+    "-no-strip" # keep everything under nix/store
+    "-offset $(stat -L -c%s ${lib.escapeShellArg mkappimage-runtime})"
+    "-all-root"
+  ] ++ lib.optionals (compression != null) (
+    (import ./compression.nix).${compression} or (throw
+      "mkBaseLayer: unknown compression profile '${compression}'")
+  ) ++ squashfsArgs)}
+
+  dd if=${lib.escapeShellArg mkappimage-runtime} of=$out conv=notrunc
+  chmod 755 $out
+''
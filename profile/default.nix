@@ -0,0 +1,11 @@
+{ writeShellApplication
+, coreutils
+, gawk
+, strace
+}:
+
+writeShellApplication {
+  name = "profile-startup";
+  runtimeInputs = [ coreutils gawk strace ];
+  text = builtins.readFile ./startup.sh;
+}
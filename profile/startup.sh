@@ -0,0 +1,158 @@
+# shellcheck shell=bash
+# Startup file-access profiler for nix-appimage.
+#
+# Runs an AppImage under strace and prints the store paths it opened or
+# executed, in the order they were first used, each with how many bytes of it
+# were read or mapped. Pass the result to mkAppImage as `startupProfile`, and
+# those files are placed first in the image, next to each other, and AppRun
+# reads them into the page cache while it sets up.
+
+usage() {
+	cat <<USAGE
+Usage: profile-startup [OPTIONS] IMAGE [ARGS...]
+
+Runs IMAGE with ARGS, and prints the store paths it opened during startup,
+each followed by how much of it was used.
+
+Options:
+  -o, --output FILE    write the profile to FILE instead of stdout
+  -t, --timeout SECS   stop the program after SECS seconds, for programs that
+                       don't exit by themselves (default: no timeout)
+  -w, --window MS      only count files used in the first MS milliseconds
+                       (default: until the program exits)
+
+The image is mounted with --appimage-mount first and only its AppRun is
+traced, since fusermount can't mount anything once it's being traced.
+USAGE
+}
+
+output=/dev/stdout
+timeout=
+window=
+
+while [ $# -gt 0 ]; do
+	case "$1" in
+	-o | --output) output=$2; shift 2 ;;
+	-t | --timeout) timeout=$2; shift 2 ;;
+	-w | --window) window=$2; shift 2 ;;
+	-h | --help) usage; exit 0 ;;
+	--) shift; break ;;
+	-*) usage >&2; exit 2 ;;
+	*) break ;;
+	esac
+done
+if [ $# -lt 1 ]; then
+	usage >&2
+	exit 2
+fi
+image=$(realpath "$1")
+shift
+
+workdir=$(mktemp -d)
+mount_pid=
+cleanup() {
+	if [ -n "$mount_pid" ]; then
+		kill "$mount_pid" 2>/dev/null || true
+		wait "$mount_pid" 2>/dev/null || true
+	fi
+	rm -rf "$workdir"
+}
+trap cleanup EXIT
+
+# the runtime prints the mount point, and keeps it mounted until killed
+mkfifo "$workdir/mounted"
+"$image" --appimage-mount >"$workdir/mounted" &
+mount_pid=$!
+mountpoint=
+read -r mountpoint <"$workdir/mounted" || true
+if [ -z "$mountpoint" ] || ! [ -x "$mountpoint/AppRun" ]; then
+	echo "cannot mount $image" >&2
+	exit 1
+fi
+
+# the same environment the runtime sets up for AppRun
+export APPDIR=$mountpoint APPIMAGE=$image ARGV0=$image OWD=$PWD
+
+runner=()
+if [ -n "$timeout" ]; then
+	runner=(timeout --signal=INT "$timeout")
+fi
+
+# reads are traced raw, so that strace doesn't print the data read, and mmaps
+# with the paths of their fds
+status=0
+"${runner[@]}" strace --follow-forks --quiet=all --string-limit=65536 --output="$workdir/strace" \
+	--absolute-timestamps=format:unix,precision:us --decode-fds=path \
+	--trace=open,openat,openat2,execve,execveat,read,pread64,mmap --raw=read,pread64 \
+	"$mountpoint/AppRun" "$@" || status=$?
+if [ "$status" -ne 0 ]; then
+	echo "note: the program exited with status $status" >&2
+fi
+
+# Successful calls only, keeping the first time each path was used. How much
+# of a file is used is the furthest any mmap, pread or read of it reached;
+# reads are assumed to be sequential from where the file was opened, which is
+# what ld.so and most file formats do.
+gawk -v window="$window" '
+	/ = -1 / { next }
+	{
+		pid = $1
+		if (start == "") {
+			start = $2
+		}
+		if (window != "" && ($2 - start) * 1000 > window) {
+			exit
+		}
+	}
+	function use(path, end) {
+		if (!(path in used)) {
+			order[n++] = path
+			used[path] = 0
+		}
+		if (end > used[path]) {
+			used[path] = end
+		}
+	}
+	/ (read|pread64)\(0x/ {
+		match($0, /\(0x[0-9a-f]+/)
+		fd = strtonum(substr($0, RSTART + 1, RLENGTH - 1))
+		if (!((pid, fd) in fd_path)) {
+			next
+		}
+		match($0, /= 0x[0-9a-f]+$/)
+		got = strtonum(substr($0, RSTART + 2))
+		if ($3 ~ /^pread64/) {
+			split($0, args, ", ")
+			use(fd_path[pid, fd], strtonum(substr(args[4], 1, index(args[4], ")") - 1)) + got)
+		} else {
+			fd_pos[pid, fd] += got
+			use(fd_path[pid, fd], fd_pos[pid, fd])
+		}
+		next
+	}
+	/ mmap\(/ {
+		if (match($0, /, [0-9]+<\/nix\/store\/[^>]*>, /)) {
+			path = substr($0, RSTART, RLENGTH)
+			sub(/^, [0-9]+</, "", path)
+			sub(/>, $/, "", path)
+			split($0, args, ", ")
+			offset = substr(args[6], 1, index(args[6], ")") - 1)
+			use(path, strtonum(offset) + strtonum(args[2]))
+		}
+		next
+	}
+	match($0, /"\/nix\/store\/[^"]*"/) {
+		path = substr($0, RSTART + 1, RLENGTH - 2)
+		use(path, 0)
+		if (match($0, /= [0-9]+</)) {
+			fd = substr($0, RSTART + 2, RLENGTH - 3)
+			fd_path[pid, fd] = path
+			fd_pos[pid, fd] = 0
+		}
+	}
+	END {
+		for (i = 0; i < n; i++) {
+			print order[i], used[order[i]]
+		}
+	}
+' "$workdir/strace" >"$output"
@@ -0,0 +1,161 @@
+#!/usr/bin/env bash
+set -euo pipefail
+
+# Print mksquashfs wildcard excludes for the files in a closure that the
+# program can't need: documentation, headers, static archives, and shared
+# libraries that nothing in the image loads. Translations (share/locale) only
+# go too with PRUNE_LOCALES=1, since translated programs need them.
+#
+# Usage: prune-closure.sh PROGRAM CLOSURE [KEEP_PATTERN...]
+#
+# Only libraries directly in a lib/ directory are candidates for removal, since
+# that's where DT_NEEDED entries are found. Plugins and modules elsewhere
+# (lib/python3.*/, lib/qt-*/plugins/, ...) may be dlopen()ed at any time, so
+# they're kept, and so is everything they need. Libraries found by following
+# DT_NEEDED and RUNPATH from the program and every other remaining ELF file are
+# kept, as is any library mentioned by its full path.
+#
+# Files matching a KEEP_PATTERN (a glob against the absolute path) are always
+# kept, along with what they need. This is for libraries that are dlopen()ed by
+# name, which can't be found by looking at the ELF headers.
+
+program=$1
+closure=$2
+shift 2
+keep_patterns=("$@")
+prune_locales=${PRUNE_LOCALES:-0}
+
+is_elf() {
+	local magic=
+	LC_ALL=C IFS= read -r -n 4 -d '' magic <"$1" || true
+	[ "$magic" = $'\177ELF' ]
+}
+
+kept() {
+	local pattern
+	for pattern in "${keep_patterns[@]}"; do
+		# shellcheck disable=SC2053 # deliberately a glob
+		if [[ $1 == $pattern ]]; then
+			return 0
+		fi
+	done
+	return 1
+}
+
+# whether a file could be dropped, and what kind it is
+declare -A category=()
+
+is_library() {
+	local storepath=$1 file=$2
+	[[ ${file#"$storepath"/} == lib/*.so || ${file#"$storepath"/} == lib/*.so.* ]] &&
+		[[ ${file#"$storepath"/lib/} != */* ]] && is_elf "$file"
+}
+
+is_dead_weight() {
+	case /${1#"$2"/} in
+	/share/doc/* | /share/man/* | /share/info/* | /share/gtk-doc/* | \
+		/include/* | /lib/pkgconfig/* | *.a | *.la)
+		return 0
+		;;
+	/share/locale/*)
+		[ "$prune_locales" = 1 ]
+		return
+		;;
+	esac
+	return 1
+}
+
+declare -A reached=() # files that stay, by canonical path
+queue=()
+
+reach() {
+	local path
+	path=$(realpath -e "$1" 2>/dev/null) || return 0
+	if [ -f "$path" ] && [ -z "${reached[$path]:-}" ]; then
+		reached[$path]=1
+		queue+=("$path")
+	fi
+}
+
+# sort the closure into candidates for removal, and the roots of the walk
+reach "$program"
+while IFS= read -r storepath; do
+	while IFS= read -r -d '' file; do
+		if kept "$file"; then
+			reach "$file"
+		elif is_dead_weight "$file" "$storepath"; then
+			category[$file]=dead-weight
+		elif is_library "$storepath" "$file"; then
+			category[$file]=library
+		elif is_elf "$file"; then
+			reach "$file"
+		fi
+	done < <(find "$storepath" -type f -print0)
+done <"$closure"
+
+# what ld.so would do to find a DT_NEEDED entry. RUNPATH is meant to only
+# apply to an object's own dependencies, but searching the ones of whatever
+# led to it too can only ever keep more.
+declare -A search_path=() # inherited library search path, by object
+interp_dirs=
+
+resolve_needed() {
+	local object=$1 needed=$2 dirs=$3 dir origin
+	origin=$(dirname "$object")
+	if [[ $needed == */* ]]; then
+		reach "$needed"
+		return
+	fi
+	local IFS=:
+	for dir in $dirs; do
+		dir=${dir//\$\{ORIGIN\}/$origin}
+		dir=${dir//\$ORIGIN/$origin}
+		if [ -n "$dir" ] && [ -e "$dir/$needed" ]; then
+			reach "$dir/$needed"
+			return
+		fi
+	done
+	echo "warning: $object needs $needed, which isn't in its search path" >&2
+}
+
+for ((i = 0; i < ${#queue[@]}; i++)); do
+	file=${queue[i]}
+
+	# libraries named by their full path, e.g. in a wrapper script
+	while IFS= read -r ref; do
+		reach "$ref"
+	done < <(grep -aoE '/nix/store/[a-z0-9]{32}-[^/[:space:]]+/lib/[^/[:space:]"'\'';:]+\.so[^/[:space:]"'\'';:]*' "$file" | sort -u)
+
+	if ! is_elf "$file"; then
+		continue
+	fi
+
+	if interp=$(patchelf --print-interpreter "$file" 2>/dev/null); then
+		reach "$interp"
+		case ":$interp_dirs:" in
+		*":$(dirname "$interp"):"*) ;;
+		*) interp_dirs=$interp_dirs:$(dirname "$interp") ;;
+		esac
+	fi
+
+	dirs=$(patchelf --print-rpath "$file" 2>/dev/null || true):${search_path[$file]:-}
+	first_new=${#queue[@]}
+	while IFS= read -r needed; do
+		if [ -n "$needed" ]; then
+			resolve_needed "$file" "$needed" "$dirs$interp_dirs"
+		fi
+	done < <(patchelf --print-needed "$file" 2>/dev/null || true)
+
+	# pass this object's search path on to what it loaded
+	for ((j = first_new; j < ${#queue[@]}; j++)); do
+		search_path[${queue[j]}]=$dirs
+	done
+done
+
+# excludes are matched wherever the store path is in the image, which is fine
+# since its name is unique
+for file in "${!category[@]}"; do
+	if [ -z "${reached[$file]:-}" ]; then
+		printf '... %s\n' "$(printf '%s' "${file#/nix/store/}" | sed -e 's/[][*?\\[:space:]]/\\&/g')"
+	fi
+done | LC_ALL=C sort
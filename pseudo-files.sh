@@ -0,0 +1,35 @@
+#!/bin/sh
+set -eu
+
+# Print mksquashfs pseudo file definitions that place the contents of each
+# directory given as an argument at the root of the image, so they can be added
+# in the same run as the store closure.
+
+# pseudo file names are whitespace separated, so escape that and backslashes
+escape_name() {
+	printf '%s' "$1" | sed -e 's/[\\[:space:]]/\\&/g'
+}
+
+# data commands are run by /bin/sh
+quote_command_arg() {
+	printf "'%s'" "$(printf '%s' "$1" | sed -e "s/'/'\\\\''/g")"
+}
+
+for root in "$@"; do
+	root=$(realpath "$root")
+	# parents come before their children, as mksquashfs needs
+	find "$root" -mindepth 1 | LC_ALL=C sort | while IFS= read -r path; do
+		name=$(escape_name "${path#"$root"/}")
+		mode=$(stat -c %a "$path")
+		if [ -L "$path" ]; then
+			echo "$name s $mode 0 0 $(readlink "$path")"
+		elif [ -d "$path" ]; then
+			echo "$name d $mode 0 0"
+		elif [ -f "$path" ]; then
+			echo "$name f $mode 0 0 cat $(quote_command_arg "$path")"
+		else
+			echo "'$path' is not a file, directory or symlink" >&2
+			exit 1
+		fi
+	done
+done
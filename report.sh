@@ -0,0 +1,110 @@
+#!/usr/bin/env bash
+set -euo pipefail
+
+# Print what each store path in an AppImage's closure contributes to it, as
+# report.json and report.txt in OUT.
+#
+# Usage: report.sh OUT IMAGE OFFSET CLOSURE [MKSQUASHFS_ARG...]
+#
+# The image's squashfs (starting at OFFSET) is unpacked, and for each path in
+# CLOSURE this counts the files and bytes that made it into the image, and the
+# bytes of the path in the store that didn't (left out by excludes or pruning).
+# The compressed size is that of the path squashed on its own with
+# MKSQUASHFS_ARGS (the image's compression settings), so it doesn't count
+# fragments and duplicate files that are shared with other paths. If the image
+# has a startup profile, the files it lists, and the bytes of them read at
+# startup, are counted as well.
+
+out=$1
+image=$2
+offset=$3
+closure=$4
+shift 4
+squashfs_args=("$@")
+
+unsquashfs -q -no-xattrs -o "$offset" -d root "$image" >/dev/null
+
+# the total size of the regular files under a directory, and how many there are
+dir_size() {
+	find "$1" -type f -printf '%s\n' | awk '{ n++; bytes += $1 } END { print n + 0, bytes + 0 }'
+}
+
+startup=
+if [ -f root/startup-files ]; then
+	startup=root/startup-files
+fi
+
+# one line per store path, tab separated
+while read -r path; do
+	read -r store_files store_bytes < <(dir_size "$path")
+	if [ ! -e "root$path" ]; then
+		# e.g. in the base layer
+		printf '%s\tfalse\t0\t0\t0\t%s\t%s\t0' "$path" "$store_files" "$store_bytes"
+	else
+		read -r files bytes < <(dir_size "root$path")
+		mksquashfs "root$path" part.sqfs -noappend -no-progress -no-xattrs "${squashfs_args[@]}" >/dev/null
+		compressed=$(stat -c %s part.sqfs)
+		rm part.sqfs
+		printf '%s\ttrue\t%s\t%s\t%s\t%s\t%s\t%s' "$path" "$files" "$bytes" "$compressed" \
+			"$store_files" "$store_bytes" "$((store_bytes - bytes))"
+	fi
+	if [ -n "$startup" ]; then
+		awk -v path="$path" -v OFS='\t' '
+			$1 == path || index($1, path "/") == 1 { n++; bytes += $2 }
+			END { print "", n + 0, bytes + 0 }
+		' "$startup"
+	else
+		printf '\tnull\tnull\n'
+	fi
+done <"$closure" >paths.tsv
+
+mkdir -p "$out"
+jq -R -n --arg image "$(basename "$image")" --argjson size "$(stat -L -c %s "$image")" '
+	[inputs | split("\t") | {
+		path: .[0],
+		in_image: (.[1] == "true"),
+		files: (.[2] | tonumber),
+		bytes: (.[3] | tonumber),
+		compressed_bytes: (.[4] | tonumber),
+		store_files: (.[5] | tonumber),
+		store_bytes: (.[6] | tonumber),
+		excluded_bytes: (.[7] | tonumber),
+		startup_files: (.[8] | fromjson),
+		startup_bytes: (.[9] | fromjson)
+	}] | sort_by(-.compressed_bytes) as $paths
+	| {
+		image: $image,
+		size: $size,
+		paths: $paths,
+		total: (reduce ($paths[] | del(.path, .in_image) | to_entries[]) as $e ({};
+			.[$e.key] = if $e.value == null then null else (.[$e.key] // 0) + $e.value end))
+	}
+' paths.tsv >"$out/report.json"
+
+# the same, largest first
+jq -r '
+	def unit($n; $name): . / $n * 10 | round / 10 | "\(.) \($name)";
+	def human:
+		if . == null then "-"
+		elif . < 1024 then "\(.) B"
+		elif . < 1048576 then unit(1024; "KiB")
+		elif . < 1073741824 then unit(1048576; "MiB")
+		else unit(1073741824; "GiB") end;
+	def row: [.files, (.bytes | human), (.compressed_bytes | human), (.excluded_bytes | human),
+		(.startup_files // "-"), (.startup_bytes | human)];
+	(["path", "files", "size", "compressed", "excluded", "startup_files", "startup_read"]
+	, (.paths[] | [.path + (if .in_image then "" else " (not in image)" end)] + row)
+	, (["total"] + (.total | row))
+	, ["image", "-", "-", (.size | human), "-", "-", "-"])
+	| @tsv
+' "$out/report.json" | awk -F '\t' '
+	{ rows[NR] = $0; for (i = 1; i <= NF; i++) if (length($i) > width[i]) width[i] = length($i) }
+	END {
+		for (r = 1; r <= NR; r++) {
+			n = split(rows[r], field, "\t")
+			line = sprintf("%-" width[1] "s", field[1])
+			for (i = 2; i <= n; i++) line = line sprintf("  %" width[i] "s", field[i])
+			print line
+		}
+	}
+' >"$out/report.txt"
@@ -0,0 +1,31 @@
+{ appimage-type2-runtime
+, curl
+}:
+
+# the type2 runtime, reading the image from a URL instead of its own file
+appimage-type2-runtime.overrideAttrs (old: {
+  pname = "appimage-stream-runtime";
+
+  buildInputs = old.buildInputs ++ [ curl ];
+
+  configurePhase = old.configurePhase + ''
+    $PKG_CONFIG --static --libs libcurl > curl-libs
+  '';
+
+  buildPhase = ''
+    # stream.c takes over main() to fetch the image's metadata and point the
+    # runtime at a local copy, and squashfuse's reads of it to fetch the rest
+    # on demand, once the FUSE server has mounted it; fuse-tuning.c and fuse-stats.c are shared with the type2
+    # runtime
+    $CC src/runtime/runtime.c ${./stream.c} ${../appimage-type2-runtime/fuse-tuning.c} ${../appimage-type2-runtime/fuse-stats.c} -o $out \
+      -D_FILE_OFFSET_BITS=64 -DGIT_COMMIT='"0000000"' \
+      -Wl,--wrap=main,--wrap=sqfs_pread,--wrap=fuse_session_mount \
+      -Wl,--wrap=fuse_session_loop,--wrap=fuse_reply_open,--wrap=fuse_reply_entry,--wrap=fuse_reply_attr \
+      -Wl,--wrap=sqfs_read_range \
+      -Wl,--wrap=fuse_session_new,--wrap=sqfs_decompressor_get \
+      $(cat cflags) \
+      -std=gnu99 -Os -ffunction-sections -fdata-sections -Wl,--gc-sections -static -pthread -Wall -Werror \
+      -lsquashfuse -lsquashfuse_ll -lfuse3 -lzstd -lz -llzma -llz4 -llzo2 $(cat curl-libs) \
+      -T src/runtime/data_sections.ld
+  '';
+})
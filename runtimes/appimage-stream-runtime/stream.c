@@ -0,0 +1,681 @@
+// Streaming AppImages over HTTP, for the type2 runtime.
+//
+// This runtime isn't followed by a squashfs: it's given the URL of an
+// AppImage instead, e.g. `appimage-stream https://example.com/hello.AppImage
+// --version`. The image is mirrored into a sparse file under
+// $XDG_CACHE_HOME/nix-appimage/stream/, which the upstream runtime is pointed
+// at with TARGET_APPIMAGE, and each read squashfuse makes of it (see
+// -Wl,--wrap=sqfs_pread) first fetches the parts it covers that aren't there
+// yet, with HTTP range requests. So starting a program only downloads what it
+// reads, however large the image is.
+//
+// - Before mounting, the runtime's ELF, the squashfs superblock and the
+//   metadata tables after the file data (inodes, directories, fragments, ids)
+//   are fetched, so that lookups never wait on the network.
+// - The image is fetched in chunks of chunk_size bytes, which are marked in a
+//   `chunks` file next to it once they're there, and kept for later runs.
+//   Copies are named after the URL and the image's version (its size, ETag or
+//   Last-Modified, and superblock); other versions of the same URL are removed
+//   once nothing uses them.
+// - Once the FUSE server has mounted the image (see
+//   -Wl,--wrap=fuse_session_mount), NIX_APPIMAGE_STREAM_CONNECTIONS threads
+//   (default 4) prefetch the first NIX_APPIMAGE_STREAM_PREFETCH MiB of file
+//   data (default 64). Images built with a startupProfile store the files
+//   used at startup first, so that's mostly what they get.
+// - Every thread, prefetching or serving FUSE requests, has a connection of
+//   its own, so concurrent misses are fetched in parallel.
+
+#define _GNU_SOURCE
+#include <curl/curl.h>
+#include <dirent.h>
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef int64_t sqfs_off_t;
+
+int __real_main(int argc, char **argv);
+ssize_t __real_sqfs_pread(int fd, void *buf, size_t count, sqfs_off_t off);
+struct fuse_session;
+int __real_fuse_session_mount(struct fuse_session *se, const char *mountpoint);
+
+#define SQUASHFS_MAGIC 0x73717368
+
+struct squashfs_super_block {
+  uint32_t s_magic;
+  uint32_t inodes;
+  uint32_t mkfs_time;
+  uint32_t block_size;
+  uint32_t fragments;
+  uint16_t compression;
+  uint16_t block_log;
+  uint16_t flags;
+  uint16_t no_ids;
+  uint16_t s_major;
+  uint16_t s_minor;
+  uint64_t root_inode;
+  uint64_t bytes_used;
+  uint64_t id_table_start;
+  uint64_t xattr_id_table_start;
+  uint64_t inode_table_start;
+  uint64_t directory_table_start;
+  uint64_t fragment_table_start;
+  uint64_t lookup_table_start;
+} __attribute__((packed));
+
+static const uint64_t chunk_size = 256 * 1024;
+// how many chunks a prefetching thread asks for at once
+static const uint64_t prefetch_batch = 4;
+static const long default_connections = 4;
+static const long default_prefetch_mib = 64;
+
+static const char *argv0;
+
+static struct {
+  const char *url;
+  char if_range[256]; // a strong ETag, if the server gave one
+  uint64_t size;
+  uint64_t data_start, data_end; // the squashfs' file data
+  int fd;
+  uint64_t nchunks;
+  unsigned char *present; // the mapped `chunks` file, 1 for each copied chunk
+  unsigned char *fetching; // chunks some thread of ours is fetching
+  pthread_mutex_t lock;
+  pthread_cond_t fetched;
+  bool serving; // set in the FUSE server, once it has mounted the image
+  pid_t prefetch_pid; // the process prefetchers were started in
+  uint64_t next_prefetch, prefetch_end; // chunk indices
+} stream = {
+    .fd = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .fetched = PTHREAD_COND_INITIALIZER,
+};
+
+static long env_long(const char *name, long fallback) {
+  const char *value = getenv(name);
+  if (!value || value[0] == 0) {
+    return fallback;
+  }
+  char *end;
+  long parsed = strtol(value, &end, 10);
+  return *end == 0 && parsed >= 0 ? parsed : fallback;
+}
+
+static uint64_t fnv1a_update(uint64_t hash, const void *data, size_t len) {
+  const unsigned char *bytes = data;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static bool pwrite_full(int fd, const void *buf, size_t size, off_t off) {
+  while (size > 0) {
+    ssize_t n = pwrite(fd, buf, size, off);
+    if (n <= 0) {
+      return false;
+    }
+    buf = (const char *)buf + n;
+    size -= n;
+    off += n;
+  }
+  return true;
+}
+
+// HTTP ------------------------------------------------------------------------
+
+struct transfer {
+  uint64_t offset, len, done;
+  unsigned char *buf; // or NULL to write into the copy of the image
+  // from the last response's headers
+  long status;
+  uint64_t total;
+  char etag[256];
+  char last_modified[256];
+};
+
+static size_t on_header(char *data, size_t size, size_t nmemb, void *ctx) {
+  struct transfer *t = ctx;
+  size_t len = size * nmemb;
+  char line[512];
+  if (len >= sizeof(line)) {
+    return len;
+  }
+  memcpy(line, data, len);
+  line[len] = 0;
+  line[strcspn(line, "\r\n")] = 0;
+
+  const char *value = strchr(line, ':');
+  value = value ? value + 1 + strspn(value + 1, " \t") : "";
+  if (strncmp(line, "HTTP/", 5) == 0) {
+    // a new response, after a redirect
+    const char *space = strchr(line, ' ');
+    t->status = space ? strtol(space + 1, NULL, 10) : 0;
+    t->total = 0;
+    t->etag[0] = t->last_modified[0] = 0;
+  } else if (strncasecmp(line, "content-range:", 14) == 0) {
+    const char *slash = strchr(value, '/');
+    t->total = slash ? strtoull(slash + 1, NULL, 10) : 0;
+  } else if (strncasecmp(line, "etag:", 5) == 0) {
+    snprintf(t->etag, sizeof(t->etag), "%s", value);
+  } else if (strncasecmp(line, "last-modified:", 14) == 0) {
+    snprintf(t->last_modified, sizeof(t->last_modified), "%s", value);
+  }
+  return len;
+}
+
+static size_t on_data(char *data, size_t size, size_t nmemb, void *ctx) {
+  struct transfer *t = ctx;
+  size_t len = size * nmemb;
+  // anything but the range we asked for aborts the transfer
+  if (t->status != 206 || len > t->len - t->done) {
+    return 0;
+  }
+  if (t->buf) {
+    memcpy(t->buf + t->done, data, len);
+  } else if (!pwrite_full(stream.fd, data, len, t->offset + t->done)) {
+    return 0;
+  }
+  t->done += len;
+  return len;
+}
+
+// each thread keeps its connection, but not across fork()
+static __thread CURL *thread_curl;
+static __thread pid_t thread_curl_pid;
+
+static CURL *connection(void) {
+  if (!thread_curl || thread_curl_pid != getpid()) {
+    thread_curl = curl_easy_init();
+    thread_curl_pid = getpid();
+  }
+  return thread_curl;
+}
+
+static int fetch(struct transfer *t) {
+  CURL *curl = connection();
+  if (!curl) {
+    return -1;
+  }
+  char range[64];
+  snprintf(range, sizeof(range), "%llu-%llu", (unsigned long long)t->offset,
+           (unsigned long long)(t->offset + t->len - 1));
+  // if the image changed since, the server sends all of it, which we refuse
+  char if_range[sizeof(stream.if_range) + 16];
+  struct curl_slist *headers = NULL;
+  if (stream.if_range[0] != 0) {
+    snprintf(if_range, sizeof(if_range), "If-Range: %s", stream.if_range);
+    headers = curl_slist_append(NULL, if_range);
+  }
+
+  curl_easy_reset(curl);
+  curl_easy_setopt(curl, CURLOPT_URL, stream.url);
+  curl_easy_setopt(curl, CURLOPT_RANGE, range);
+  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+  curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+  curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+  // give up on a stalled connection rather than hanging the app forever
+  curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+  curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 60L);
+  curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, on_header);
+  curl_easy_setopt(curl, CURLOPT_HEADERDATA, t);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, on_data);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, t);
+  CURLcode res = curl_easy_perform(curl);
+  curl_slist_free_all(headers);
+
+  // the last range may be cut short by the end of the image
+  bool complete = t->done == t->len ||
+                  (t->total != 0 && t->offset + t->done == t->total);
+  if (res != CURLE_OK || t->status != 206 || !complete) {
+    const char *reason = res != CURLE_OK ? curl_easy_strerror(res)
+                                         : "short response";
+    if (t->status == 200) {
+      reason = "the image changed, or the server doesn't do range requests";
+    }
+    fprintf(stderr, "%s: cannot fetch bytes %s of %s: %s\n", argv0, range,
+            stream.url, reason);
+    return -1;
+  }
+  return 0;
+}
+
+// Chunks ----------------------------------------------------------------------
+
+static int fetch_chunks(uint64_t first, uint64_t end) {
+  uint64_t offset = first * chunk_size;
+  uint64_t stop =
+      end * chunk_size < stream.size ? end * chunk_size : stream.size;
+  struct transfer t = {.offset = offset, .len = stop - offset};
+  return fetch(&t);
+}
+
+// copy whatever of [offset, offset + len) isn't there yet
+static int ensure(uint64_t offset, uint64_t len) {
+  if (len == 0 || offset >= stream.size) {
+    return 0;
+  }
+  uint64_t stop = stream.size - offset < len ? stream.size : offset + len;
+  uint64_t last = (stop - 1) / chunk_size;
+  int ret = 0;
+
+  pthread_mutex_lock(&stream.lock);
+  for (uint64_t i = offset / chunk_size; i <= last && ret == 0;) {
+    if (stream.present[i]) {
+      i++;
+      continue;
+    }
+    if (stream.fetching[i]) {
+      pthread_cond_wait(&stream.fetched, &stream.lock);
+      continue;
+    }
+    // take every missing chunk from here that nobody else is fetching
+    uint64_t end = i;
+    while (end <= last && !stream.present[end] && !stream.fetching[end]) {
+      stream.fetching[end++] = 1;
+    }
+    pthread_mutex_unlock(&stream.lock);
+    ret = fetch_chunks(i, end);
+    pthread_mutex_lock(&stream.lock);
+    for (uint64_t j = i; j < end; j++) {
+      stream.fetching[j] = 0;
+      if (ret == 0) {
+        stream.present[j] = 1;
+      }
+    }
+    pthread_cond_broadcast(&stream.fetched);
+    i = end;
+  }
+  pthread_mutex_unlock(&stream.lock);
+  return ret;
+}
+
+// threads of ours may be fetching (and holding the lock) when the runtime
+// forks its FUSE server, which only inherits the calling thread
+static void before_fork(void) { pthread_mutex_lock(&stream.lock); }
+
+static void after_fork_parent(void) { pthread_mutex_unlock(&stream.lock); }
+
+static void after_fork_child(void) {
+  memset(stream.fetching, 0, stream.nchunks);
+  pthread_mutex_unlock(&stream.lock);
+}
+
+static void *prefetch(void *arg) {
+  (void)arg;
+  while (true) {
+    uint64_t first = __atomic_fetch_add(&stream.next_prefetch, prefetch_batch,
+                                        __ATOMIC_RELAXED);
+    if (first >= stream.prefetch_end) {
+      return NULL;
+    }
+    uint64_t end = stream.prefetch_end - first < prefetch_batch
+                       ? stream.prefetch_end
+                       : first + prefetch_batch;
+    if (ensure(first * chunk_size, (end - first) * chunk_size) != 0) {
+      return NULL;
+    }
+  }
+}
+
+static void start_prefetch(void) {
+  long connections =
+      env_long("NIX_APPIMAGE_STREAM_CONNECTIONS", default_connections);
+  uint64_t bytes = (uint64_t)env_long("NIX_APPIMAGE_STREAM_PREFETCH",
+                                      default_prefetch_mib) * 1024 * 1024;
+  uint64_t end = stream.data_end - stream.data_start < bytes
+                     ? stream.data_end
+                     : stream.data_start + bytes;
+  stream.next_prefetch = stream.data_start / chunk_size;
+  stream.prefetch_end = (end + chunk_size - 1) / chunk_size;
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  for (long i = 0; i < connections && end > stream.data_start; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, &attr, prefetch, NULL) != 0) {
+      break;
+    }
+  }
+  pthread_attr_destroy(&attr);
+}
+
+// The runtime opens the image before it forks its FUSE server, which may
+// then daemonize, and prefetchers started before either would be gone with
+// the process they were started in. So they're only started by the first read
+// in a process that inherited (or made) the mount.
+int __wrap_fuse_session_mount(struct fuse_session *se, const char *mountpoint) {
+  int ret = __real_fuse_session_mount(se, mountpoint);
+  if (ret == 0) {
+    stream.serving = true;
+  }
+  return ret;
+}
+
+ssize_t __wrap_sqfs_pread(int fd, void *buf, size_t count, sqfs_off_t off) {
+  pid_t pid = getpid();
+  if (stream.serving &&
+      __atomic_exchange_n(&stream.prefetch_pid, pid, __ATOMIC_ACQ_REL) != pid) {
+    start_prefetch();
+  }
+  if (off < 0 || ensure(off, count) != 0) {
+    errno = EIO;
+    return -1;
+  }
+  return __real_sqfs_pread(fd, buf, count, off);
+}
+
+// Opening the image -----------------------------------------------------------
+
+// where the section header table is, from the ELF header
+static bool elf_sht(const unsigned char *head, size_t len, bool *is64,
+                    uint64_t *off, uint64_t *size) {
+  if (len < sizeof(Elf64_Ehdr) || memcmp(head, ELFMAG, SELFMAG) != 0) {
+    return false;
+  }
+  *is64 = head[EI_CLASS] == ELFCLASS64;
+  if (*is64) {
+    const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *)head;
+    *off = ehdr->e_shoff;
+    *size = (uint64_t)ehdr->e_shentsize * ehdr->e_shnum;
+    return ehdr->e_shentsize == sizeof(Elf64_Shdr);
+  }
+  const Elf32_Ehdr *ehdr = (const Elf32_Ehdr *)head;
+  *off = ehdr->e_shoff;
+  *size = (uint64_t)ehdr->e_shentsize * ehdr->e_shnum;
+  return ehdr->e_shentsize == sizeof(Elf32_Shdr);
+}
+
+// like run-cache.c's elf_size(): the end of the section header table or of
+// the last section, whichever is later
+static uint64_t elf_end(const unsigned char *sht, bool is64, uint64_t off,
+                        uint64_t size) {
+  uint64_t end = off + size;
+  size_t entsize = is64 ? sizeof(Elf64_Shdr) : sizeof(Elf32_Shdr);
+  for (uint64_t pos = 0; pos < size; pos += entsize) {
+    uint64_t type, sh_offset, sh_size;
+    if (is64) {
+      const Elf64_Shdr *shdr = (const Elf64_Shdr *)(sht + pos);
+      type = shdr->sh_type;
+      sh_offset = shdr->sh_offset;
+      sh_size = shdr->sh_size;
+    } else {
+      const Elf32_Shdr *shdr = (const Elf32_Shdr *)(sht + pos);
+      type = shdr->sh_type;
+      sh_offset = shdr->sh_offset;
+      sh_size = shdr->sh_size;
+    }
+    if (type != SHT_NOBITS && sh_offset + sh_size > end) {
+      end = sh_offset + sh_size;
+    }
+  }
+  return end;
+}
+
+// find the image's size, version and layout with a few small requests,
+// leaving its first chunk in `head`; returns the offset of the squashfs, or 0
+// on failure
+static uint64_t probe_image(struct transfer *head,
+                            struct squashfs_super_block *sb,
+                            uint64_t *version) {
+  *head = (struct transfer){.len = chunk_size, .buf = malloc(chunk_size)};
+  if (!head->buf || fetch(head) != 0) {
+    return 0;
+  }
+  stream.size = head->total;
+  const char *validator = head->etag[0] != 0 ? head->etag : head->last_modified;
+  *version = fnv1a_update(fnv1a_update(0xcbf29ce484222325ULL, &stream.size,
+                                       sizeof(stream.size)),
+                          validator, strlen(validator));
+  // If-Range needs a strong validator
+  if (head->etag[0] == '"') {
+    snprintf(stream.if_range, sizeof(stream.if_range), "%s", head->etag);
+  }
+
+  bool is64;
+  uint64_t sht_off, sht_size;
+  bool ok = elf_sht(head->buf, head->done, &is64, &sht_off, &sht_size);
+  if (!ok || sht_off + sht_size + sizeof(*sb) > stream.size) {
+    fprintf(stderr, "%s: %s isn't an AppImage\n", argv0, stream.url);
+    return 0;
+  }
+
+  // the superblock usually follows the section header table
+  unsigned char *sht = malloc(sht_size + sizeof(*sb));
+  struct transfer t = {
+      .offset = sht_off, .len = sht_size + sizeof(*sb), .buf = sht};
+  if (!sht || fetch(&t) != 0) {
+    free(sht);
+    return 0;
+  }
+  uint64_t offset = elf_end(sht, is64, sht_off, sht_size);
+  memcpy(sb, sht + sht_size, sizeof(*sb));
+  free(sht);
+  if (offset != sht_off + sht_size) {
+    t = (struct transfer){
+        .offset = offset, .len = sizeof(*sb), .buf = (unsigned char *)sb};
+    if (offset + sizeof(*sb) > stream.size || fetch(&t) != 0) {
+      return 0;
+    }
+  }
+
+  if (sb->s_magic != SQUASHFS_MAGIC || sb->inode_table_start > sb->bytes_used ||
+      sb->bytes_used > stream.size - offset) {
+    fprintf(stderr, "%s: %s has no squashfs\n", argv0, stream.url);
+    return 0;
+  }
+  *version = fnv1a_update(*version, sb, sizeof(*sb));
+  return offset;
+}
+
+// $XDG_CACHE_HOME/nix-appimage/stream, or ~/.cache/nix-appimage/stream,
+// creating it if needed
+static char *stream_cache_dir(void) {
+  const char *xdg = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  char *dir;
+  if (xdg && xdg[0] == '/') {
+    dir = strdup(xdg);
+  } else if (home && home[0] == '/') {
+    if (asprintf(&dir, "%s/.cache", home) < 0) {
+      return NULL;
+    }
+  } else {
+    return NULL;
+  }
+
+  static const char *const subdirs[] = {"", "/nix-appimage", "/stream"};
+  for (size_t i = 0; dir && i < sizeof(subdirs) / sizeof(*subdirs); i++) {
+    char *sub;
+    if (asprintf(&sub, "%s%s", dir, subdirs[i]) < 0) {
+      sub = NULL;
+    }
+    free(dir);
+    dir = sub;
+    if (dir && mkdir(dir, 0700) < 0 && errno != EEXIST) {
+      free(dir);
+      dir = NULL;
+    }
+  }
+  return dir;
+}
+
+static int open_in(const char *dir, const char *name, int flags) {
+  char *path;
+  if (asprintf(&path, "%s/%s", dir, name) < 0) {
+    return -1;
+  }
+  int fd = open(path, flags | O_CLOEXEC, 0600);
+  free(path);
+  return fd;
+}
+
+// remove the copies of other versions of the image that nobody's using
+static void remove_old_versions(const char *cache, const char *prefix,
+                                const char *current) {
+  DIR *dir = opendir(cache);
+  if (!dir) {
+    return;
+  }
+  static const char *const files[] = {"image", "chunks", "lock"};
+  struct dirent *entry;
+  while ((entry = readdir(dir))) {
+    if (strncmp(entry->d_name, prefix, strlen(prefix)) != 0 ||
+        strcmp(entry->d_name, current) == 0) {
+      continue;
+    }
+    char *old;
+    if (asprintf(&old, "%s/%s", cache, entry->d_name) < 0) {
+      break;
+    }
+    int dirfd = open(old, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int lock = dirfd >= 0 ? openat(dirfd, "lock", O_RDONLY | O_CLOEXEC) : -1;
+    if (lock >= 0 && flock(lock, LOCK_EX | LOCK_NB) == 0) {
+      for (size_t i = 0; i < sizeof(files) / sizeof(*files); i++) {
+        unlinkat(dirfd, files[i], 0);
+      }
+      rmdir(old);
+    }
+    if (lock >= 0) {
+      close(lock);
+    }
+    if (dirfd >= 0) {
+      close(dirfd);
+    }
+    free(old);
+  }
+  closedir(dir);
+}
+
+static void *ensure_tables(void *end) {
+  uint64_t tables_end = *(const uint64_t *)end;
+  intptr_t ret = ensure(stream.data_end, tables_end - stream.data_end);
+  return (void *)ret;
+}
+
+// set up the local copy of the image and fetch what mounting it needs;
+// returns its path
+static char *open_stream(void) {
+  struct transfer head;
+  struct squashfs_super_block sb;
+  uint64_t version;
+  uint64_t offset = probe_image(&head, &sb, &version);
+  if (offset == 0) {
+    return NULL;
+  }
+  stream.data_start = offset + sizeof(sb);
+  stream.data_end = offset + sb.inode_table_start;
+  uint64_t tables_end = offset + sb.bytes_used;
+  stream.nchunks = (stream.size + chunk_size - 1) / chunk_size;
+
+  char *cache = stream_cache_dir();
+  if (!cache) {
+    fprintf(stderr, "%s: no cache directory, set XDG_CACHE_HOME\n", argv0);
+    return NULL;
+  }
+  char prefix[18], name[35];
+  snprintf(prefix, sizeof(prefix), "%016llx-",
+           (unsigned long long)fnv1a_update(0xcbf29ce484222325ULL, stream.url,
+                                            strlen(stream.url)));
+  snprintf(name, sizeof(name), "%s%016llx", prefix,
+           (unsigned long long)version);
+  char *dir;
+  if (asprintf(&dir, "%s/%s", cache, name) < 0) {
+    free(cache);
+    return NULL;
+  }
+  mkdir(dir, 0700);
+
+  // held by the FUSE server, so that the copy isn't removed under it
+  int lock = open_in(dir, "lock", O_RDWR | O_CREAT);
+  int chunks = open_in(dir, "chunks", O_RDWR | O_CREAT);
+  stream.fd = open_in(dir, "image", O_RDWR | O_CREAT);
+  struct stat statbuf;
+  if (lock < 0 || flock(lock, LOCK_SH) < 0 || chunks < 0 || stream.fd < 0 ||
+      fstat(stream.fd, &statbuf) < 0 ||
+      ((uint64_t)statbuf.st_size != stream.size &&
+       ftruncate(stream.fd, stream.size) < 0) ||
+      ftruncate(chunks, stream.nchunks) < 0) {
+    fprintf(stderr, "%s: cannot set up %s: %s\n", argv0, dir, strerror(errno));
+    return NULL;
+  }
+  stream.present = mmap(NULL, stream.nchunks, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, chunks, 0);
+  close(chunks);
+  stream.fetching = calloc(stream.nchunks, 1);
+  if (stream.present == MAP_FAILED || !stream.fetching) {
+    fprintf(stderr, "%s: cannot map %s/chunks: %s\n", argv0, dir,
+            strerror(errno));
+    return NULL;
+  }
+
+  if (head.done == (stream.size < chunk_size ? stream.size : chunk_size) &&
+      pwrite_full(stream.fd, head.buf, head.done, 0)) {
+    stream.present[0] = 1;
+  }
+  free(head.buf);
+
+  remove_old_versions(cache, prefix, name);
+  free(cache);
+
+  // the tables are at the very end, so they're fetched on another connection
+  // while this one gets the runtime
+  pthread_t tables;
+  bool threaded =
+      pthread_create(&tables, NULL, ensure_tables, &tables_end) == 0;
+  int ret = ensure(0, stream.data_start);
+  void *tables_ret = threaded ? NULL : ensure_tables(&tables_end);
+  if (threaded) {
+    pthread_join(tables, &tables_ret);
+  }
+  if (ret != 0 || tables_ret != NULL) {
+    return NULL;
+  }
+
+  char *image;
+  if (asprintf(&image, "%s/image", dir) < 0) {
+    return NULL;
+  }
+  free(dir);
+  return image;
+}
+
+int __wrap_main(int argc, char **argv) {
+  argv0 = argv[0];
+  if (argc < 2 || (strncmp(argv[1], "http://", 7) != 0 &&
+                   strncmp(argv[1], "https://", 8) != 0)) {
+    fprintf(stderr, "usage: %s URL [ARGS...]\n", argv0);
+    return 1;
+  }
+  stream.url = argv[1];
+  if (curl_global_init(CURL_GLOBAL_DEFAULT) != CURLE_OK) {
+    fprintf(stderr, "%s: cannot initialize libcurl\n", argv0);
+    return 1;
+  }
+
+  char *image = open_stream();
+  if (!image) {
+    return 1;
+  }
+  setenv("TARGET_APPIMAGE", image, 1);
+  pthread_atfork(before_fork, after_fork_parent, after_fork_child);
+
+  // the rest of the arguments are for the image
+  argv[1] = argv[0];
+  return __real_main(argc - 1, argv + 1);
+}
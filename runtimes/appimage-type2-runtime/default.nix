@@ -28,6 +28,8 @@ let
   squashfuse' = (squashfuse.override {
     fuse3 = fuse3';
   }).overrideAttrs (old: {
+    # locks its caches, so fuse-tuning.c can serve requests from many threads
+    configureFlags = (old.configureFlags or []) ++ [ "--enable-multithreading" ];
     postInstall = (old.postInstall or "") + ''
       cp *.h -t $out/include/squashfuse/
     '';
@@ -59,10 +61,18 @@ stdenv.mkDerivation {
   '';
 
   buildPhase = ''
-    $CC src/runtime/runtime.c -o $out \
+    # run-cache.c takes over main() to start cached extractions, zygotes
+    # (zygote.c), kernel mounts for root (kernel-mount.c) or mounts shared with
+    # other instances (shared-mount.c), fuse-tuning.c makes the FUSE server
+    # multi-threaded and cache harder, and fuse-stats.c counts what it does
+    $CC src/runtime/runtime.c ${./run-cache.c} ${./zygote.c} ${./kernel-mount.c} ${./shared-mount.c} ${./fuse-tuning.c} ${./fuse-stats.c} -o $out \
       -D_FILE_OFFSET_BITS=64 -DGIT_COMMIT='"0000000"' \
+      -Wl,--wrap=main \
+      -Wl,--wrap=fuse_session_loop,--wrap=fuse_reply_open,--wrap=fuse_reply_entry,--wrap=fuse_reply_attr \
+      -Wl,--wrap=sqfs_read_range \
+      -Wl,--wrap=fuse_session_new,--wrap=sqfs_decompressor_get \
       $(cat cflags) \
-      -std=gnu99 -Os -ffunction-sections -fdata-sections -Wl,--gc-sections -static -Wall -Werror \
+      -std=gnu99 -Os -ffunction-sections -fdata-sections -Wl,--gc-sections -static -pthread -Wall -Werror \
       -lsquashfuse -lsquashfuse_ll -lfuse3 -lzstd -lz -llzma -llz4 -llzo2 \
       -T src/runtime/data_sections.ld
 
@@ -0,0 +1,677 @@
+// FUSE I/O statistics for the type2 and stream runtimes.
+//
+// With NIX_APPIMAGE_FUSE_STATS set to a path or a file descriptor number, the
+// FUSE server counts:
+//
+// - requests and the time spent serving them, by opcode
+// - bytes served to reads, and bytes read per file
+// - calls, compressed and decompressed bytes, and time per codec
+// - hits and misses of fuse-tuning.c's block cache
+//
+// These are written there as one JSON object when the image is unmounted, and
+// whenever the server gets SIGUSR1. A path is replaced with each snapshot, an
+// fd gets one line per snapshot. The signal goes to the FUSE server rather
+// than the app, whose pid is in each snapshot and in the trace's "fuse-init"
+// line.
+//
+// With NIX_APPIMAGE_TRACE set as well, every request is also written to the
+// trace in AppRun's format, with "source":"fuse" and the opcode as the phase.
+// The timestamps are from the same clock, so summing the fuse lines that fall
+// within each of AppRun's phases (or the app's own startup, after "exec")
+// shows how long those spent waiting on the image. They're buffered, up to
+// max_events of them between snapshots, and written out with each one.
+//
+// All of it is linked in with -Wl,--wrap=fuse_session_new and
+// -Wl,--wrap=sqfs_decompressor_get. Without the variable, the FUSE operations
+// are left as they are.
+
+#define _GNU_SOURCE
+#define FUSE_USE_VERSION 312
+#include <fuse_lowlevel.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef int sqfs_err;
+typedef sqfs_err (*sqfs_decompressor)(void *in, size_t insz, void *out,
+                                      size_t *outsz);
+
+struct fuse_session *__real_fuse_session_new(struct fuse_args *args,
+                                             const struct fuse_lowlevel_ops *op,
+                                             size_t op_size, void *userdata);
+sqfs_decompressor __real_sqfs_decompressor_get(int type);
+
+enum op {
+  op_lookup,
+  op_forget,
+  op_forget_multi,
+  op_getattr,
+  op_readlink,
+  op_open,
+  op_read,
+  op_release,
+  op_opendir,
+  op_readdir,
+  op_releasedir,
+  op_statfs,
+  op_getxattr,
+  op_listxattr,
+  nops,
+};
+
+static const char *const op_names[nops] = {
+    "lookup",  "forget",     "forget_multi", "getattr", "readlink",
+    "open",    "read",       "release",      "opendir", "readdir",
+    "releasedir", "statfs",  "getxattr",     "listxattr",
+};
+
+// squashfs' compression ids
+static const char *const codec_names[] = {
+    NULL, "gzip", "lzma", "lzo", "xz", "lz4", "zstd",
+};
+enum { ncodecs = sizeof(codec_names) / sizeof(codec_names[0]) };
+
+enum { max_files = 1 << 16, max_events = 1 << 16 };
+
+struct op_stats {
+  uint64_t count;
+  uint64_t ns;
+};
+
+struct codec_stats {
+  uint64_t calls;
+  uint64_t compressed_bytes;
+  uint64_t bytes;
+  uint64_t ns;
+};
+
+// what lookups said about an inode, and what was read from it
+struct file_stats {
+  fuse_ino_t ino; // 0 for an empty slot
+  fuse_ino_t parent;
+  char *name;
+  uint64_t bytes;
+  uint64_t reads;
+};
+
+struct event {
+  uint64_t start_ns;
+  uint64_t end_ns;
+  fuse_ino_t ino;
+  uint64_t bytes;
+  enum op op;
+};
+
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static bool stats_enabled;
+static const char *stats_path; // or NULL for stats_fd
+static int stats_fd = -1;
+static int trace_fd = -1;
+static uint64_t start_ns;
+
+static struct fuse_lowlevel_ops real_ops;
+static struct op_stats ops[nops];
+static struct codec_stats codecs[ncodecs];
+static uint64_t bytes_served, cache_hits, cache_misses;
+
+static sqfs_decompressor real_decompressor;
+static int codec;
+
+// files and events, and writing snapshots out
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct file_stats *files;
+static size_t nfiles;
+static struct event *events;
+static size_t nevents, events_written, events_dropped;
+
+// what the current thread's request has read, and is looking up
+static __thread uint64_t thread_served;
+static __thread fuse_ino_t lookup_parent;
+static __thread const char *lookup_name;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void add(uint64_t *counter, uint64_t n) {
+  __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static uint64_t load(const uint64_t *counter) {
+  return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+// a number is an inherited fd, like AppRun's NIX_APPIMAGE_TRACE
+static int env_fd(const char *value) {
+  char *end;
+  long fd = strtol(value, &end, 10);
+  if (*end == 0 && fd >= 0 && fd <= INT_MAX && fcntl(fd, F_GETFD) >= 0) {
+    return (int)fd;
+  }
+  return -1;
+}
+
+static void stats_init(void) {
+  const char *env = getenv("NIX_APPIMAGE_FUSE_STATS");
+  if (!env || env[0] == 0) {
+    return;
+  }
+  stats_fd = env_fd(env);
+  if (stats_fd < 0) {
+    stats_path = env;
+  }
+
+  const char *trace = getenv("NIX_APPIMAGE_TRACE");
+  if (trace && trace[0] != 0) {
+    trace_fd = env_fd(trace);
+    if (trace_fd < 0) {
+      trace_fd =
+          open(trace, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    }
+    // allocated as it's used
+    events = trace_fd >= 0 ? calloc(max_events, sizeof(*events)) : NULL;
+  }
+  files = calloc(max_files, sizeof(*files));
+  stats_enabled = files != NULL;
+}
+
+static bool enabled(void) {
+  pthread_once(&stats_once, stats_init);
+  return stats_enabled;
+}
+
+// Counting --------------------------------------------------------------------
+
+static uint64_t mix(uint64_t key) {
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  return key;
+}
+
+// the slot for an inode, added if `insert` and there's room; call with
+// stats_lock held
+static struct file_stats *file_slot(fuse_ino_t ino, bool insert) {
+  size_t i = mix(ino) % max_files;
+  for (size_t probes = 0; probes < max_files; probes++) {
+    if (files[i].ino == ino) {
+      return &files[i];
+    }
+    if (files[i].ino == 0) {
+      // keep probe sequences short
+      if (!insert || nfiles >= max_files / 4 * 3) {
+        return NULL;
+      }
+      nfiles++;
+      files[i].ino = ino;
+      return &files[i];
+    }
+    i = (i + 1) % max_files;
+  }
+  return NULL;
+}
+
+static void request_done(enum op op, uint64_t start, fuse_ino_t ino,
+                         uint64_t bytes) {
+  uint64_t end = now_ns();
+  add(&ops[op].count, 1);
+  add(&ops[op].ns, end - start);
+  if (op != op_read && !events) {
+    return;
+  }
+
+  pthread_mutex_lock(&stats_lock);
+  if (op == op_read) {
+    struct file_stats *file = file_slot(ino, true);
+    if (file) {
+      file->bytes += bytes;
+      file->reads++;
+    }
+  }
+  if (events && nevents < max_events) {
+    events[nevents++] = (struct event){start, end, ino, bytes, op};
+  } else if (events) {
+    events_dropped++;
+  }
+  pthread_mutex_unlock(&stats_lock);
+}
+
+// fuse-tuning.c reports what sqfs_read_range returned, and its cache lookups
+void fuse_stats_served(uint64_t bytes) {
+  if (stats_enabled) {
+    add(&bytes_served, bytes);
+    thread_served += bytes;
+  }
+}
+
+void fuse_stats_cache(bool hit) {
+  if (stats_enabled) {
+    add(hit ? &cache_hits : &cache_misses, 1);
+  }
+}
+
+// ...and the inode of each entry a lookup replies with, naming it
+void fuse_stats_entry(fuse_ino_t ino) {
+  if (!lookup_name || ino == 0) {
+    return;
+  }
+  pthread_mutex_lock(&stats_lock);
+  struct file_stats *file = file_slot(ino, true);
+  if (file && !file->name) {
+    file->parent = lookup_parent;
+    file->name = strdup(lookup_name);
+  }
+  pthread_mutex_unlock(&stats_lock);
+}
+
+static sqfs_err stats_decompress(void *in, size_t insz, void *out,
+                                 size_t *outsz) {
+  uint64_t start = now_ns();
+  sqfs_err err = real_decompressor(in, insz, out, outsz);
+  struct codec_stats *stats = &codecs[codec];
+  add(&stats->calls, 1);
+  add(&stats->compressed_bytes, insz);
+  add(&stats->bytes, err == 0 ? *outsz : 0);
+  add(&stats->ns, now_ns() - start);
+  return err;
+}
+
+// an image has a single codec, picked when it's opened
+sqfs_decompressor __wrap_sqfs_decompressor_get(int type) {
+  sqfs_decompressor real = __real_sqfs_decompressor_get(type);
+  if (!real || type <= 0 || type >= ncodecs || !enabled()) {
+    return real;
+  }
+  real_decompressor = real;
+  codec = type;
+  return stats_decompress;
+}
+
+// Operations ------------------------------------------------------------------
+//
+// Each one squashfuse registers is replaced by one that times it. squashfuse
+// replies before returning, so that's the whole of the request.
+
+static void stats_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  uint64_t start = now_ns();
+  lookup_parent = parent;
+  lookup_name = name;
+  real_ops.lookup(req, parent, name);
+  lookup_name = NULL;
+  request_done(op_lookup, start, parent, 0);
+}
+
+static void stats_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+  uint64_t start = now_ns();
+  real_ops.forget(req, ino, nlookup);
+  request_done(op_forget, start, ino, 0);
+}
+
+static void stats_forget_multi(fuse_req_t req, size_t count,
+                               struct fuse_forget_data *forgets) {
+  uint64_t start = now_ns();
+  real_ops.forget_multi(req, count, forgets);
+  request_done(op_forget_multi, start, 0, 0);
+}
+
+static void stats_getattr(fuse_req_t req, fuse_ino_t ino,
+                          struct fuse_file_info *fi) {
+  uint64_t start = now_ns();
+  real_ops.getattr(req, ino, fi);
+  request_done(op_getattr, start, ino, 0);
+}
+
+static void stats_readlink(fuse_req_t req, fuse_ino_t ino) {
+  uint64_t start = now_ns();
+  real_ops.readlink(req, ino);
+  request_done(op_readlink, start, ino, 0);
+}
+
+static void stats_open(fuse_req_t req, fuse_ino_t ino,
+                       struct fuse_file_info *fi) {
+  uint64_t start = now_ns();
+  real_ops.open(req, ino, fi);
+  request_done(op_open, start, ino, 0);
+}
+
+static void stats_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                       struct fuse_file_info *fi) {
+  uint64_t start = now_ns();
+  thread_served = 0;
+  real_ops.read(req, ino, size, off, fi);
+  request_done(op_read, start, ino, thread_served);
+}
+
+static void stats_release(fuse_req_t req, fuse_ino_t ino,
+                          struct fuse_file_info *fi) {
+  uint64_t start = now_ns();
+  real_ops.release(req, ino, fi);
+  request_done(op_release, start, ino, 0);
+}
+
+static void stats_opendir(fuse_req_t req, fuse_ino_t ino,
+                          struct fuse_file_info *fi) {
+  uint64_t start = now_ns();
+  real_ops.opendir(req, ino, fi);
+  request_done(op_opendir, start, ino, 0);
+}
+
+static void stats_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                          off_t off, struct fuse_file_info *fi) {
+  uint64_t start = now_ns();
+  real_ops.readdir(req, ino, size, off, fi);
+  request_done(op_readdir, start, ino, 0);
+}
+
+static void stats_releasedir(fuse_req_t req, fuse_ino_t ino,
+                             struct fuse_file_info *fi) {
+  uint64_t start = now_ns();
+  real_ops.releasedir(req, ino, fi);
+  request_done(op_releasedir, start, ino, 0);
+}
+
+static void stats_statfs(fuse_req_t req, fuse_ino_t ino) {
+  uint64_t start = now_ns();
+  real_ops.statfs(req, ino);
+  request_done(op_statfs, start, ino, 0);
+}
+
+static void stats_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+                           size_t size) {
+  uint64_t start = now_ns();
+  real_ops.getxattr(req, ino, name, size);
+  request_done(op_getxattr, start, ino, 0);
+}
+
+static void stats_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size) {
+  uint64_t start = now_ns();
+  real_ops.listxattr(req, ino, size);
+  request_done(op_listxattr, start, ino, 0);
+}
+
+// Export ----------------------------------------------------------------------
+
+static void json_string(FILE *out, const char *str) {
+  fputc('"', out);
+  for (; *str; str++) {
+    unsigned char c = *str;
+    if (c == '"' || c == '\\') {
+      fprintf(out, "\\%c", c);
+    } else if (c < 0x20) {
+      fprintf(out, "\\u%04x", c);
+    } else {
+      fputc(c, out);
+    }
+  }
+  fputc('"', out);
+}
+
+// the path of an inode, from the names its lookups were answered with; call
+// with stats_lock held
+static void file_path(FILE *out, const struct file_stats *file) {
+  const char *names[PATH_MAX / 2];
+  size_t depth = 0;
+  bool complete = false;
+  for (const struct file_stats *at = file;
+       at && at->name && depth < sizeof(names) / sizeof(names[0]);
+       at = file_slot(at->parent, false)) {
+    names[depth++] = at->name;
+    if (at->parent == FUSE_ROOT_ID) {
+      complete = true;
+      break;
+    }
+  }
+  if (!complete) {
+    // looked up before we started counting, or a table full of other files
+    fprintf(out, "\"inode:%llu\"", (unsigned long long)file->ino);
+    return;
+  }
+
+  char *path;
+  size_t len;
+  FILE *buf = open_memstream(&path, &len);
+  if (!buf) {
+    fputs("null", out);
+    return;
+  }
+  while (depth > 0) {
+    fprintf(buf, "/%s", names[--depth]);
+  }
+  fclose(buf);
+  json_string(out, path);
+  free(path);
+}
+
+static int by_bytes(const void *a, const void *b) {
+  const struct file_stats *x = *(struct file_stats *const *)a;
+  const struct file_stats *y = *(struct file_stats *const *)b;
+  return x->bytes < y->bytes ? 1 : x->bytes > y->bytes ? -1 : 0;
+}
+
+// call with stats_lock held
+static void write_files(FILE *out) {
+  struct file_stats **read = malloc((nfiles + 1) * sizeof(*read));
+  size_t nread = 0;
+  for (size_t i = 0; read && i < max_files; i++) {
+    if (files[i].reads > 0) {
+      read[nread++] = &files[i];
+    }
+  }
+  if (read) {
+    qsort(read, nread, sizeof(*read), by_bytes);
+  }
+
+  fputs("\"files\":[", out);
+  for (size_t i = 0; i < nread; i++) {
+    fprintf(out, "%s{\"path\":", i > 0 ? "," : "");
+    file_path(out, read[i]);
+    fprintf(out, ",\"bytes\":%llu,\"reads\":%llu}",
+            (unsigned long long)read[i]->bytes,
+            (unsigned long long)read[i]->reads);
+  }
+  fputs("]", out);
+  free(read);
+}
+
+static void write_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return;
+    }
+    buf += n;
+    len -= n;
+  }
+}
+
+// the events since the last snapshot, as trace lines; call with stats_lock
+// held
+static void write_events(void) {
+  char *buf;
+  size_t len;
+  FILE *out = open_memstream(&buf, &len);
+  if (!out) {
+    return;
+  }
+  int pid = getpid();
+  for (; events_written < nevents; events_written++) {
+    const struct event *event = &events[events_written];
+    fprintf(out,
+            "{\"source\":\"fuse\",\"pid\":%d,\"phase\":\"%s\","
+            "\"start_ns\":%llu,\"end_ns\":%llu,\"ino\":%llu",
+            pid, op_names[event->op], (unsigned long long)event->start_ns,
+            (unsigned long long)event->end_ns,
+            (unsigned long long)event->ino);
+    if (event->op == op_read) {
+      fprintf(out, ",\"bytes\":%llu", (unsigned long long)event->bytes);
+    }
+    fputs("}\n", out);
+  }
+  fclose(out);
+  // O_APPEND, so this doesn't interleave with other writers' lines
+  write_all(trace_fd, buf, len);
+  free(buf);
+  nevents = events_written = 0;
+}
+
+static void write_snapshot(bool final) {
+  // one at a time, so they don't interleave on stats_fd
+  static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+  pthread_mutex_lock(&snapshot_lock);
+  char *buf;
+  size_t len;
+  FILE *out = open_memstream(&buf, &len);
+  if (!out) {
+    pthread_mutex_unlock(&snapshot_lock);
+    return;
+  }
+
+  fprintf(out,
+          "{\"source\":\"fuse\",\"pid\":%d,\"final\":%s,\"start_ns\":%llu,"
+          "\"end_ns\":%llu,\"requests\":{",
+          (int)getpid(), final ? "true" : "false",
+          (unsigned long long)start_ns, (unsigned long long)now_ns());
+  bool first = true;
+  for (int i = 0; i < nops; i++) {
+    if (load(&ops[i].count) == 0) {
+      continue;
+    }
+    fprintf(out, "%s\"%s\":{\"count\":%llu,\"ns\":%llu}", first ? "" : ",",
+            op_names[i], (unsigned long long)load(&ops[i].count),
+            (unsigned long long)load(&ops[i].ns));
+    first = false;
+  }
+  fprintf(out, "},\"bytes_served\":%llu,\"decompression\":{",
+          (unsigned long long)load(&bytes_served));
+  first = true;
+  for (int i = 1; i < ncodecs; i++) {
+    if (load(&codecs[i].calls) == 0) {
+      continue;
+    }
+    fprintf(out,
+            "%s\"%s\":{\"calls\":%llu,\"compressed_bytes\":%llu,"
+            "\"bytes\":%llu,\"ns\":%llu}",
+            first ? "" : ",", codec_names[i],
+            (unsigned long long)load(&codecs[i].calls),
+            (unsigned long long)load(&codecs[i].compressed_bytes),
+            (unsigned long long)load(&codecs[i].bytes),
+            (unsigned long long)load(&codecs[i].ns));
+    first = false;
+  }
+  fprintf(out, "},\"block_cache\":{\"hits\":%llu,\"misses\":%llu},",
+          (unsigned long long)load(&cache_hits),
+          (unsigned long long)load(&cache_misses));
+
+  pthread_mutex_lock(&stats_lock);
+  write_files(out);
+  fprintf(out, ",\"events_dropped\":%zu}\n", events_dropped);
+  fclose(out);
+  if (events) {
+    write_events();
+  }
+  pthread_mutex_unlock(&stats_lock);
+
+  if (stats_path) {
+    // readers only ever see a whole snapshot
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.%d", stats_path, (int)getpid()) <
+        (int)sizeof(tmp)) {
+      int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+      if (fd >= 0) {
+        write_all(fd, buf, len);
+        close(fd);
+        rename(tmp, stats_path);
+      }
+    }
+  } else {
+    write_all(stats_fd, buf, len);
+  }
+  free(buf);
+  pthread_mutex_unlock(&snapshot_lock);
+}
+
+// fuse-tuning.c calls this once the session loop returns, i.e. on unmount
+void fuse_stats_unmounted(void) {
+  if (stats_enabled) {
+    write_snapshot(true);
+  }
+}
+
+static void *signal_thread(void *arg) {
+  sigset_t *set = arg;
+  for (;;) {
+    int sig;
+    if (sigwait(set, &sig) == 0) {
+      write_snapshot(false);
+    }
+  }
+  return NULL;
+}
+
+// SIGUSR1 is blocked before squashfuse starts its threads, so they all leave
+// it to signal_thread
+static void start_signal_thread(void) {
+  static sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  pthread_t thread;
+  if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0 ||
+      pthread_create(&thread, NULL, signal_thread, &set) != 0) {
+    return;
+  }
+  pthread_detach(thread);
+}
+
+struct fuse_session *__wrap_fuse_session_new(struct fuse_args *args,
+                                             const struct fuse_lowlevel_ops *op,
+                                             size_t op_size, void *userdata) {
+  if (!enabled() || op_size > sizeof(real_ops)) {
+    return __real_fuse_session_new(args, op, op_size, userdata);
+  }
+  start_ns = now_ns();
+
+  memcpy(&real_ops, op, op_size);
+  static struct fuse_lowlevel_ops counted;
+  counted = real_ops;
+  // only the ones squashfuse has, leaving the rest to libfuse's defaults
+  counted.lookup = real_ops.lookup ? stats_lookup : NULL;
+  counted.forget = real_ops.forget ? stats_forget : NULL;
+  counted.forget_multi = real_ops.forget_multi ? stats_forget_multi : NULL;
+  counted.getattr = real_ops.getattr ? stats_getattr : NULL;
+  counted.readlink = real_ops.readlink ? stats_readlink : NULL;
+  counted.open = real_ops.open ? stats_open : NULL;
+  counted.read = real_ops.read ? stats_read : NULL;
+  counted.release = real_ops.release ? stats_release : NULL;
+  counted.opendir = real_ops.opendir ? stats_opendir : NULL;
+  counted.readdir = real_ops.readdir ? stats_readdir : NULL;
+  counted.releasedir = real_ops.releasedir ? stats_releasedir : NULL;
+  counted.statfs = real_ops.statfs ? stats_statfs : NULL;
+  counted.getxattr = real_ops.getxattr ? stats_getxattr : NULL;
+  counted.listxattr = real_ops.listxattr ? stats_listxattr : NULL;
+
+  start_signal_thread();
+  if (trace_fd >= 0) {
+    char line[256];
+    int len = snprintf(line, sizeof(line),
+                       "{\"source\":\"fuse\",\"pid\":%d,\"phase\":\"fuse-init\","
+                       "\"start_ns\":%llu,\"end_ns\":%llu}\n",
+                       (int)getpid(), (unsigned long long)start_ns,
+                       (unsigned long long)now_ns());
+    write_all(trace_fd, line, len);
+  }
+  return __real_fuse_session_new(args, &counted, sizeof(counted), userdata);
+}
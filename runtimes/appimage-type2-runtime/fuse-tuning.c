@@ -0,0 +1,314 @@
+// FUSE serving tweaks for the type2 runtime.
+//
+// Like run-cache.c, this is linked in with -Wl,--wrap=..., leaving the upstream
+// runtime and squashfuse sources alone:
+//
+// - fuse_session_loop is replaced by the multi-threaded loop, so apps that
+//   fault in many files from many threads at startup aren't serialized behind
+//   a single reader. NIX_APPIMAGE_FUSE_THREADS caps the number of threads.
+// - Since the image is immutable, the kernel may keep file contents in its
+//   page cache across opens, and attributes, entries and negative lookups
+//   never expire.
+// - sqfs_read_range gets a sharded cache of decompressed file data in front of
+//   it, sized by NIX_APPIMAGE_BLOCK_CACHE (in MiB, 0 disables it). squashfuse's
+//   own block caches only hold a handful of blocks, which concurrent readers
+//   evict from each other constantly.
+//
+// fuse-stats.c is told about cache lookups, what reads return and unmounting.
+
+#define _GNU_SOURCE
+#define FUSE_USE_VERSION 312
+#include <fuse_lowlevel.h>
+#include <float.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// fuse-stats.c
+void fuse_stats_served(uint64_t bytes);
+void fuse_stats_cache(bool hit);
+void fuse_stats_entry(fuse_ino_t ino);
+void fuse_stats_unmounted(void);
+
+// The kernel is never asked to revalidate anything
+static const double forever = DBL_MAX;
+
+static long env_long(const char *name, long fallback) {
+  const char *value = getenv(name);
+  if (!value || value[0] == 0) {
+    return fallback;
+  }
+  char *end;
+  long parsed = strtol(value, &end, 10);
+  return *end == 0 && parsed >= 0 ? parsed : fallback;
+}
+
+// Kernel-side caching ----------------------------------------------------------
+
+int __real_fuse_reply_open(fuse_req_t req, const struct fuse_file_info *fi);
+int __real_fuse_reply_entry(fuse_req_t req, const struct fuse_entry_param *e);
+int __real_fuse_reply_attr(fuse_req_t req, const struct stat *attr,
+                           double attr_timeout);
+
+int __wrap_fuse_reply_open(fuse_req_t req, const struct fuse_file_info *fi) {
+  struct fuse_file_info cached = *fi;
+  cached.keep_cache = 1;
+  return __real_fuse_reply_open(req, &cached);
+}
+
+int __wrap_fuse_reply_entry(fuse_req_t req, const struct fuse_entry_param *e) {
+  struct fuse_entry_param cached = *e;
+  cached.attr_timeout = forever;
+  cached.entry_timeout = forever;
+  fuse_stats_entry(e->ino);
+  return __real_fuse_reply_entry(req, &cached);
+}
+
+int __wrap_fuse_reply_attr(fuse_req_t req, const struct stat *attr,
+                           double attr_timeout) {
+  (void)attr_timeout;
+  return __real_fuse_reply_attr(req, attr, forever);
+}
+
+// Multi-threaded loop ----------------------------------------------------------
+
+int __real_fuse_session_loop(struct fuse_session *se);
+
+int __wrap_fuse_session_loop(struct fuse_session *se) {
+  long threads = env_long("NIX_APPIMAGE_FUSE_THREADS", -1);
+  struct fuse_loop_config *config =
+      threads == 1 ? NULL : fuse_loop_cfg_create();
+  int ret;
+  if (!config) {
+    ret = __real_fuse_session_loop(se);
+  } else {
+    if (threads > 1) {
+      fuse_loop_cfg_set_max_threads(config, threads);
+    }
+    ret = fuse_session_loop_mt(se, config);
+    fuse_loop_cfg_destroy(config);
+  }
+  fuse_stats_unmounted();
+  return ret;
+}
+
+// Decompressed data cache ------------------------------------------------------
+//
+// File contents are cached in chunks of chunk_size bytes, keyed by inode number
+// and chunk index. A file's fragment tail is just its last chunk, so it's
+// cached the same way as full blocks. The cache is split into shards, each
+// with its own lock, and each shard is a set-associative table: a chunk can
+// only live in one of `ways` slots, and the least recently used one is
+// replaced on a miss.
+
+// squashfuse's sqfs_inode starts with the on-disk base inode
+struct squashfs_base_inode {
+  uint16_t inode_type;
+  uint16_t mode;
+  uint16_t uid;
+  uint16_t guid;
+  uint32_t mtime;
+  uint32_t inode_number;
+};
+
+typedef int64_t sqfs_off_t;
+typedef int sqfs_err;
+struct sqfs;
+
+sqfs_err __real_sqfs_read_range(struct sqfs *fs, void *inode, sqfs_off_t start,
+                                sqfs_off_t *size, void *buf);
+
+// mksquashfs' default block size, so chunks usually line up with blocks
+static const size_t chunk_size = 128 * 1024;
+static const long default_cache_mib = 64;
+enum { nshards = 16, ways = 8 };
+
+// which chunk of which file; both are compared, since no packing of the two
+// into one word fits every inode number and file size
+struct chunk_id {
+  uint32_t inode;
+  uint64_t index;
+};
+
+struct chunk {
+  struct chunk_id id;
+  uint64_t last_used; // 0 for an empty slot
+  size_t len; // less than chunk_size for a file's last chunk
+  unsigned char *data;
+};
+
+struct shard {
+  pthread_mutex_t lock;
+  uint64_t clock;
+  size_t nsets;
+  struct chunk *slots; // nsets * ways
+};
+
+static struct shard shards[nshards];
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static bool cache_enabled;
+
+static void cache_init(void) {
+  long mib = env_long("NIX_APPIMAGE_BLOCK_CACHE", default_cache_mib);
+  size_t nchunks = (size_t)mib * 1024 * 1024 / chunk_size;
+  size_t nsets = nchunks / (nshards * ways);
+  if (nsets == 0) {
+    return;
+  }
+
+  for (int i = 0; i < nshards; i++) {
+    pthread_mutex_init(&shards[i].lock, NULL);
+    shards[i].nsets = nsets;
+    // chunk buffers are allocated on first use
+    shards[i].slots = calloc(nsets * ways, sizeof(struct chunk));
+    if (!shards[i].slots) {
+      return;
+    }
+  }
+  cache_enabled = true;
+}
+
+static bool chunk_is(const struct chunk *chunk, struct chunk_id id) {
+  return chunk->last_used != 0 && chunk->id.inode == id.inode &&
+         chunk->id.index == id.index;
+}
+
+// mix the id's bits, so neighbouring chunks spread over shards and sets
+static uint64_t chunk_hash(struct chunk_id id) {
+  uint64_t h = id.index ^ (uint64_t)id.inode * 0x9e3779b97f4a7c15ULL;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static struct shard *chunk_shard(struct chunk_id id) {
+  return &shards[chunk_hash(id) % nshards];
+}
+
+static struct chunk *chunk_set(struct shard *shard, struct chunk_id id) {
+  return &shard->slots[chunk_hash(id) / nshards % shard->nsets * ways];
+}
+
+// copy up to len bytes of a cached chunk, starting at offset, into buf;
+// returns the number of bytes copied, or -1 on a miss
+static sqfs_off_t cache_get(struct chunk_id id, size_t offset, size_t len,
+                            void *buf) {
+  struct shard *shard = chunk_shard(id);
+  sqfs_off_t ret = -1;
+
+  pthread_mutex_lock(&shard->lock);
+  struct chunk *set = chunk_set(shard, id);
+  for (int i = 0; i < ways; i++) {
+    if (chunk_is(&set[i], id)) {
+      set[i].last_used = ++shard->clock;
+      if (offset >= set[i].len) {
+        ret = 0;
+      } else {
+        ret = set[i].len - offset < len ? set[i].len - offset : len;
+        memcpy(buf, set[i].data + offset, ret);
+      }
+      break;
+    }
+  }
+  pthread_mutex_unlock(&shard->lock);
+  return ret;
+}
+
+static void cache_put(struct chunk_id id, const void *data, size_t len) {
+  struct shard *shard = chunk_shard(id);
+
+  pthread_mutex_lock(&shard->lock);
+  struct chunk *set = chunk_set(shard, id);
+  struct chunk *victim = &set[0];
+  for (int i = 0; i < ways; i++) {
+    if (chunk_is(&set[i], id)) {
+      // another thread got here first
+      victim = NULL;
+      break;
+    }
+    if (set[i].last_used < victim->last_used) {
+      victim = &set[i];
+    }
+  }
+  if (victim && !victim->data) {
+    victim->data = malloc(chunk_size);
+  }
+  if (victim && victim->data) {
+    victim->id = id;
+    victim->last_used = ++shard->clock;
+    victim->len = len;
+    memcpy(victim->data, data, len);
+  }
+  pthread_mutex_unlock(&shard->lock);
+}
+
+static sqfs_err cached_read_range(struct sqfs *fs, void *inode,
+                                  sqfs_off_t start, sqfs_off_t *size,
+                                  void *buf) {
+  pthread_once(&cache_once, cache_init);
+  if (!cache_enabled || start < 0) {
+    return __real_sqfs_read_range(fs, inode, start, size, buf);
+  }
+
+  uint32_t inode_number =
+      ((const struct squashfs_base_inode *)inode)->inode_number;
+  unsigned char *out = buf;
+  sqfs_off_t done = 0;
+  unsigned char *scratch = NULL;
+
+  while (done < *size) {
+    sqfs_off_t pos = start + done;
+    uint64_t index = pos / chunk_size;
+    size_t offset = pos % chunk_size;
+    size_t want = *size - done;
+    struct chunk_id id = {inode_number, index};
+
+    sqfs_off_t got = cache_get(id, offset, want, out + done);
+    fuse_stats_cache(got >= 0);
+    if (got < 0) {
+      if (!scratch && !(scratch = malloc(chunk_size))) {
+        sqfs_off_t rest = *size - done;
+        sqfs_err err = __real_sqfs_read_range(fs, inode, pos, &rest,
+                                              out + done);
+        *size = done + rest;
+        return err;
+      }
+      sqfs_off_t len = chunk_size;
+      sqfs_err err = __real_sqfs_read_range(fs, inode, index * chunk_size,
+                                            &len, scratch);
+      if (err != 0) {
+        free(scratch);
+        *size = done;
+        return err;
+      }
+      cache_put(id, scratch, len);
+      got = len > (sqfs_off_t)offset ? len - (sqfs_off_t)offset : 0;
+      if ((size_t)got > want) {
+        got = want;
+      }
+      memcpy(out + done, scratch + offset, got);
+    }
+
+    done += got;
+    if (offset + got < chunk_size) {
+      // short chunk, so this is the end of the file
+      break;
+    }
+  }
+
+  free(scratch);
+  *size = done;
+  return 0;
+}
+
+sqfs_err __wrap_sqfs_read_range(struct sqfs *fs, void *inode, sqfs_off_t start,
+                                sqfs_off_t *size, void *buf) {
+  sqfs_err err = cached_read_range(fs, inode, start, size, buf);
+  if (err == 0) {
+    fuse_stats_served(*size);
+  }
+  return err;
+}
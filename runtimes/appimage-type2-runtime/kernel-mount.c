@@ -0,0 +1,204 @@
+// Kernel squashfs mounts for the type2 runtime, when running as root.
+//
+// A FUSE mount costs a round trip to squashfuse for every read that misses
+// the page cache, and decompresses on squashfuse's threads. Root (e.g. a
+// systemd service, or a container with CAP_SYS_ADMIN) can instead attach the
+// squashfs part of the image to a loop device and mount it with the kernel's
+// own driver. With NIX_APPIMAGE_KERNEL_MOUNT=1, run-cache.c calls this before
+// the upstream main(); if anything fails, the image is mounted with FUSE as
+// usual.
+//
+// The mount is made in a mount namespace of our own, so nobody else sees it;
+// if it fails, we go back to the host's before returning, so that the FUSE
+// mount isn't hidden away in ours. The loop device is set to detach itself
+// once it's unmounted. A cleaner process waits for the app (and everything that inherited its end of a
+// pipe) to exit, and then unmounts it and removes the mount point, like the
+// upstream runtime does for its FUSE mount.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/loop.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// run-cache.c
+off_t elf_size(int fd);
+void exec_apprun(const char *appdir, const char *image, char **argv);
+
+// LOOP_CONFIGURE is Linux 5.8+, older kernels need two ioctls
+static int loop_attach(int loop, int backing, off_t offset) {
+  struct loop_config config = {
+      .fd = backing,
+      .info = {
+          .lo_offset = offset,
+          // direct I/O skips caching the compressed image in the page cache
+          // on top of the files in it. The kernel quietly does without when
+          // the offset isn't aligned to the backing file's blocks.
+          .lo_flags = LO_FLAGS_READ_ONLY | LO_FLAGS_AUTOCLEAR |
+                      LO_FLAGS_DIRECT_IO,
+      },
+  };
+  if (ioctl(loop, LOOP_CONFIGURE, &config) == 0) {
+    return 0;
+  }
+  if (errno != EINVAL && errno != ENOTTY) {
+    return -1;
+  }
+
+  if (ioctl(loop, LOOP_SET_FD, backing) < 0) {
+    return -1;
+  }
+  struct loop_info64 info = {
+      .lo_offset = offset,
+      .lo_flags = LO_FLAGS_READ_ONLY | LO_FLAGS_AUTOCLEAR,
+  };
+  if (ioctl(loop, LOOP_SET_STATUS64, &info) < 0) {
+    ioctl(loop, LOOP_CLR_FD, 0);
+    return -1;
+  }
+  return 0;
+}
+
+// returns an fd for a loop device backed by the image's squashfs, and its path
+static int loop_open(const char *image, char *path, size_t size) {
+  int backing = open(image, O_RDONLY | O_CLOEXEC);
+  if (backing < 0) {
+    return -1;
+  }
+  off_t offset = elf_size(backing);
+  int control = open("/dev/loop-control", O_RDWR | O_CLOEXEC);
+  if (offset <= 0 || control < 0) {
+    close(backing);
+    if (control >= 0) {
+      close(control);
+    }
+    return -1;
+  }
+
+  int loop = -1;
+  // another process may grab the free device before we configure it
+  for (int attempt = 0; attempt < 8 && loop < 0; attempt++) {
+    int n = ioctl(control, LOOP_CTL_GET_FREE);
+    if (n < 0) {
+      break;
+    }
+    snprintf(path, size, "/dev/loop%d", n);
+    loop = open(path, O_RDONLY | O_CLOEXEC);
+    if (loop >= 0 && loop_attach(loop, backing, offset) < 0) {
+      close(loop);
+      loop = -1;
+      if (errno != EBUSY) {
+        break;
+      }
+    }
+  }
+  close(control);
+  close(backing);
+  return loop;
+}
+
+// unmount once everything holding the write end of `keepalive` has exited
+static void start_cleaner(const int keepalive[2], const char *mountpoint) {
+  pid_t pid = fork();
+  if (pid != 0) {
+    if (pid > 0) {
+      waitpid(pid, NULL, 0);
+    }
+    return;
+  }
+  // fork again so the cleaner is reparented away from the app
+  if (fork() != 0) {
+    _exit(0);
+  }
+  close(keepalive[1]);
+  setsid();
+  if (chdir("/") < 0) {
+    // nothing of ours is in the mount anyway
+  }
+  char buf;
+  while (read(keepalive[0], &buf, 1) < 0 && errno == EINTR) {
+  }
+  umount2(mountpoint, MNT_DETACH);
+  rmdir(mountpoint);
+  _exit(0);
+}
+
+// back to the host's mount namespace, where the FUSE mount is made
+static void leave_namespace(int host_ns, char **argv) {
+  if (setns(host_ns, CLONE_NEWNS) < 0) {
+    // the FUSE mount would only be visible to us
+    fprintf(stderr, "%s: cannot return to the host's mount namespace: %s\n",
+            argv[0], strerror(errno));
+    _exit(127);
+  }
+  close(host_ns);
+}
+
+// execs AppRun from a kernel mount of the image, or returns if that fails
+void kernel_mount_exec(const char *image, char **argv) {
+  char device[32];
+  int loop = loop_open(image, device, sizeof(device));
+  if (loop < 0) {
+    return;
+  }
+
+  const char *tmpdir = getenv("TMPDIR");
+  char mountpoint[PATH_MAX];
+  if (snprintf(mountpoint, sizeof(mountpoint), "%s/.mount_nix-XXXXXX",
+               tmpdir && tmpdir[0] == '/' ? tmpdir : "/tmp") >=
+          (int)sizeof(mountpoint) ||
+      !mkdtemp(mountpoint)) {
+    close(loop);
+    return;
+  }
+
+  // our own mount namespace, receiving the host's mounts
+  int host_ns = open("/proc/self/ns/mnt", O_RDONLY | O_CLOEXEC);
+  if (host_ns < 0 || unshare(CLONE_NEWNS) < 0) {
+    if (host_ns >= 0) {
+      close(host_ns);
+    }
+    close(loop);
+    rmdir(mountpoint);
+    return;
+  }
+  int mounted = mount(NULL, "/", NULL, MS_REC | MS_SLAVE, NULL) == 0
+                    ? mount(device, mountpoint, "squashfs",
+                            MS_RDONLY | MS_NODEV | MS_NOSUID, NULL)
+                    : -1;
+  // the mount holds its own reference now, and autoclear detaches the device
+  // once that's gone
+  close(loop);
+  if (mounted < 0) {
+    // e.g. a compression the kernel wasn't built with
+    leave_namespace(host_ns, argv);
+    rmdir(mountpoint);
+    return;
+  }
+
+  // the write end isn't close-on-exec, so the app and its children keep it
+  int keepalive[2];
+  if (pipe(keepalive) < 0) {
+    umount2(mountpoint, MNT_DETACH);
+    leave_namespace(host_ns, argv);
+    rmdir(mountpoint);
+    return;
+  }
+  start_cleaner(keepalive, mountpoint);
+  close(keepalive[0]);
+
+  exec_apprun(mountpoint, image, argv);
+
+  // the cleaner removes the mount point once this is closed
+  close(keepalive[1]);
+  leave_namespace(host_ns, argv);
+}
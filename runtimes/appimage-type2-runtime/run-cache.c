@@ -0,0 +1,357 @@
+// Extract-once run cache for the type2 runtime.
+//
+// This is linked in with -Wl,--wrap=main, so it runs before the upstream
+// runtime's main(). With NIX_APPIMAGE_RUN_CACHE=1, the image is identified by
+// a hash of its squashfs superblock and the end of its metadata tables. If
+// $XDG_CACHE_HOME/nix-appimage/run/<hash> holds a complete copy of the image,
+// its AppRun is started directly, with no FUSE mount at all. Otherwise the
+// upstream runtime mounts the image as usual, and NIX_APPIMAGE_RUN_CACHE_FILL
+// asks AppRun to populate the cache in the background for next time.
+//
+// The same key names the socket of the zygote daemon that NIX_APPIMAGE_ZYGOTE=1
+// tries first (see zygote.c), and the mount that NIX_APPIMAGE_SHARE_MOUNT=1
+// shares between instances (see shared-mount.c). Root can ask for a kernel
+// mount instead of a FUSE one, see kernel-mount.c.
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+int __real_main(int argc, char **argv);
+
+// zygote.c, kernel-mount.c and shared-mount.c
+void zygote_exec(const char *image, const char *key, char **argv);
+void kernel_mount_exec(const char *image, char **argv);
+void shared_mount_exec(const char *image, const char *key, char **argv);
+
+#define SQUASHFS_MAGIC 0x73717368
+
+struct squashfs_super_block {
+  uint32_t s_magic;
+  uint32_t inodes;
+  uint32_t mkfs_time;
+  uint32_t block_size;
+  uint32_t fragments;
+  uint16_t compression;
+  uint16_t block_log;
+  uint16_t flags;
+  uint16_t no_ids;
+  uint16_t s_major;
+  uint16_t s_minor;
+  uint64_t root_inode;
+  uint64_t bytes_used;
+  uint64_t id_table_start;
+  uint64_t xattr_id_table_start;
+  uint64_t inode_table_start;
+  uint64_t directory_table_start;
+  uint64_t fragment_table_start;
+  uint64_t lookup_table_start;
+} __attribute__((packed));
+
+static bool pread_full(int fd, void *buf, size_t size, off_t off) {
+  while (size > 0) {
+    ssize_t n = pread(fd, buf, size, off);
+    if (n <= 0) {
+      return false;
+    }
+    buf = (char *)buf + n;
+    size -= n;
+    off += n;
+  }
+  return true;
+}
+
+// The squashfs starts where the runtime's ELF ends, i.e. after the section
+// header table or the last section, whichever is later.
+off_t elf_size(int fd) {
+  Elf64_Ehdr ehdr;
+  if (!pread_full(fd, &ehdr, sizeof(ehdr), 0) ||
+      memcmp(ehdr.e_ident, ELFMAG, SELFMAG) != 0) {
+    return -1;
+  }
+
+  if (ehdr.e_ident[EI_CLASS] == ELFCLASS32) {
+    Elf32_Ehdr ehdr32;
+    if (!pread_full(fd, &ehdr32, sizeof(ehdr32), 0)) {
+      return -1;
+    }
+    off_t size = ehdr32.e_shoff + (off_t)ehdr32.e_shentsize * ehdr32.e_shnum;
+    for (uint16_t i = 0; i < ehdr32.e_shnum; i++) {
+      Elf32_Shdr shdr;
+      if (!pread_full(fd, &shdr, sizeof(shdr),
+                      ehdr32.e_shoff + (off_t)i * ehdr32.e_shentsize)) {
+        return -1;
+      }
+      if (shdr.sh_type != SHT_NOBITS &&
+          (off_t)shdr.sh_offset + shdr.sh_size > size) {
+        size = (off_t)shdr.sh_offset + shdr.sh_size;
+      }
+    }
+    return size;
+  }
+
+  off_t size = ehdr.e_shoff + (off_t)ehdr.e_shentsize * ehdr.e_shnum;
+  for (uint16_t i = 0; i < ehdr.e_shnum; i++) {
+    Elf64_Shdr shdr;
+    if (!pread_full(fd, &shdr, sizeof(shdr),
+                    ehdr.e_shoff + (off_t)i * ehdr.e_shentsize)) {
+      return -1;
+    }
+    if (shdr.sh_type != SHT_NOBITS &&
+        (off_t)(shdr.sh_offset + shdr.sh_size) > size) {
+      size = shdr.sh_offset + shdr.sh_size;
+    }
+  }
+  return size;
+}
+
+static uint64_t fnv1a_update(uint64_t hash, const void *data, size_t len) {
+  const unsigned char *bytes = data;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+// Hash the superblock, which has the image's size and where each of its
+// tables starts, and the last 8 KiB of the image: the end of the metadata,
+// where the fragment, export and id tables (and their indexes) are, which
+// change with the contents. That's enough to tell apart reproducible builds,
+// whose mkfs_time is constant, without reading all of the metadata on every
+// launch. The key only depends on the image's contents, so copies of it
+// share an entry.
+static int image_key(const char *image, char key[17]) {
+  int fd = open(image, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+
+  int ret = -1;
+  off_t offset = elf_size(fd);
+  struct squashfs_super_block sb;
+  if (offset < 0 || !pread_full(fd, &sb, sizeof(sb), offset) ||
+      sb.s_magic != SQUASHFS_MAGIC || sb.inode_table_start > sb.bytes_used) {
+    goto out;
+  }
+
+  char tail[8 * 1024];
+  size_t len = sb.bytes_used - sb.inode_table_start < sizeof(tail)
+                   ? sb.bytes_used - sb.inode_table_start
+                   : sizeof(tail);
+  if (!pread_full(fd, tail, len, offset + sb.bytes_used - len)) {
+    goto out;
+  }
+  uint64_t hash = fnv1a_update(0xcbf29ce484222325ULL, &sb, sizeof(sb));
+  hash = fnv1a_update(hash, tail, len);
+  snprintf(key, 17, "%016llx", (unsigned long long)hash);
+  ret = 0;
+
+out:
+  close(fd);
+  return ret;
+}
+
+static char *run_cache_dir(void) {
+  char *dir = NULL;
+  const char *xdg = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  if (xdg && xdg[0] == '/') {
+    if (asprintf(&dir, "%s/nix-appimage/run", xdg) < 0) {
+      return NULL;
+    }
+  } else if (home && home[0] == '/') {
+    if (asprintf(&dir, "%s/.cache/nix-appimage/run", home) < 0) {
+      return NULL;
+    }
+  }
+  return dir;
+}
+
+#define RUN_CACHE_MARKER ".nix-appimage-run-cache"
+
+static bool env_enabled(const char *name) {
+  const char *value = getenv(name);
+  return value && strcmp(value, "1") == 0;
+}
+
+// count the regular files under dirfd, and add up their sizes, closing dirfd
+static int count_files(int dirfd, bool top, unsigned long long *files,
+                       unsigned long long *bytes) {
+  DIR *dir = fdopendir(dirfd);
+  if (!dir) {
+    close(dirfd);
+    return -1;
+  }
+
+  int ret = 0;
+  struct dirent *entry;
+  while (ret == 0 && (entry = readdir(dir))) {
+    const char *name = entry->d_name;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ||
+        (top && strcmp(name, RUN_CACHE_MARKER) == 0) ||
+        entry->d_type == DT_LNK) {
+      continue;
+    }
+    struct stat statbuf;
+    if (fstatat(dirfd, name, &statbuf, AT_SYMLINK_NOFOLLOW) < 0) {
+      ret = -1;
+    } else if (S_ISDIR(statbuf.st_mode)) {
+      int sub = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      ret = sub < 0 ? -1 : count_files(sub, false, files, bytes);
+    } else if (S_ISREG(statbuf.st_mode)) {
+      (*files)++;
+      *bytes += statbuf.st_size;
+    }
+  }
+  closedir(dir);
+  return ret;
+}
+
+// AppRun drops a marker into an entry once it has checked that it's complete,
+// just before renaming the entry into place, with the key and how many files
+// and bytes it copied. Launches only check the key, so they don't have to
+// look at every file; with NIX_APPIMAGE_RUN_CACHE_VERIFY=1, the entry's files
+// are counted as well, and an entry that no longer has what the marker says
+// (e.g. files were deleted from it) is moved out of the way if nobody uses
+// it, for AppRun to remove and fill again. While an entry is in use we hold a shared lock on its marker, which
+// is deliberately inherited by AppRun and the app, so that eviction leaves it
+// alone. Returns the locked fd, or -1 if the entry isn't usable.
+static int lock_entry(const char *entry, const char *key) {
+  char *marker;
+  if (asprintf(&marker, "%s/" RUN_CACHE_MARKER, entry) < 0) {
+    return -1;
+  }
+  int fd = open(marker, O_RDONLY);
+  free(marker);
+  if (fd < 0) {
+    return -1;
+  }
+
+  char buf[64] = {0};
+  char marker_key[17];
+  unsigned long long want_files, want_bytes;
+  if (flock(fd, LOCK_SH) < 0 || read(fd, buf, sizeof(buf) - 1) <= 0 ||
+      sscanf(buf, "%16s %llu %llu", marker_key, &want_files, &want_bytes) !=
+          3 ||
+      strcmp(marker_key, key) != 0) {
+    close(fd);
+    return -1;
+  }
+
+  if (!env_enabled("NIX_APPIMAGE_RUN_CACHE_VERIFY")) {
+    return fd;
+  }
+  unsigned long long files = 0, bytes = 0;
+  int dirfd = open(entry, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dirfd >= 0 && count_files(dirfd, true, &files, &bytes) == 0 &&
+      files == want_files && bytes == want_bytes) {
+    return fd;
+  }
+
+  char *trash;
+  if (flock(fd, LOCK_EX | LOCK_NB) == 0 &&
+      asprintf(&trash, "%s.evict-%d", entry, (int)getpid()) >= 0) {
+    rename(entry, trash);
+    free(trash);
+  }
+  close(fd);
+  return -1;
+}
+
+// start AppRun from a copy of the image that's already there, with the same
+// environment the upstream runtime gives it; returns if that fails
+void exec_apprun(const char *appdir, const char *image, char **argv) {
+  char cwd[PATH_MAX];
+  if (getcwd(cwd, sizeof(cwd))) {
+    setenv("OWD", cwd, 1);
+  }
+  setenv("APPDIR", appdir, 1);
+  setenv("APPIMAGE", image, 1);
+  setenv("ARGV0", argv[0], 1);
+
+  char *apprun;
+  if (asprintf(&apprun, "%s/AppRun", appdir) >= 0) {
+    execv(apprun, argv);
+    fprintf(stderr, "%s: cannot exec %s: %s, mounting image instead\n",
+            argv[0], apprun, strerror(errno));
+    free(apprun);
+  }
+  unsetenv("APPDIR");
+}
+
+// returns if there's no usable cache entry, asking AppRun to fill it
+static void run_cache_exec(const char *image, const char *key, char **argv) {
+  char *cache = run_cache_dir();
+  if (!cache) {
+    return;
+  }
+
+  char *entry;
+  if (asprintf(&entry, "%s/%s", cache, key) < 0) {
+    free(cache);
+    return;
+  }
+  free(cache);
+
+  int lock = lock_entry(entry, key);
+  if (lock < 0) {
+    setenv("NIX_APPIMAGE_RUN_CACHE_FILL", entry, 1);
+    free(entry);
+    return;
+  }
+
+  // bump the entry's mtime, which eviction uses as its last-used time
+  utimensat(AT_FDCWD, entry, NULL, 0);
+  exec_apprun(entry, image, argv);
+
+  // something's wrong with the entry, so fall back to mounting the image
+  close(lock);
+  free(entry);
+}
+
+int __wrap_main(int argc, char **argv) {
+  bool run_cache = env_enabled("NIX_APPIMAGE_RUN_CACHE");
+  bool zygote = env_enabled("NIX_APPIMAGE_ZYGOTE");
+  bool share_mount = env_enabled("NIX_APPIMAGE_SHARE_MOUNT");
+  bool kernel_mount = env_enabled("NIX_APPIMAGE_KERNEL_MOUNT") && geteuid() == 0;
+  if ((!run_cache && !zygote && !share_mount && !kernel_mount) ||
+      (argc > 1 && strncmp(argv[1], "--appimage-", 11) == 0)) {
+    return __real_main(argc, argv);
+  }
+
+  char image[PATH_MAX];
+  if (!realpath("/proc/self/exe", image)) {
+    return __real_main(argc, argv);
+  }
+  char key[17];
+  bool have_key = (run_cache || zygote || share_mount) &&
+                  image_key(image, key) == 0;
+
+  // each of these only returns if it can't start AppRun
+  if (have_key && zygote) {
+    // no daemon to hand us a ready root
+    zygote_exec(image, key, argv);
+  }
+  if (have_key && run_cache) {
+    run_cache_exec(image, key, argv);
+  }
+  if (kernel_mount) {
+    kernel_mount_exec(image, argv);
+  }
+  if (have_key && share_mount) {
+    shared_mount_exec(image, key, argv);
+  }
+  return __real_main(argc, argv);
+}
@@ -0,0 +1,294 @@
+// One FUSE mount for every instance of an image, for the type2 runtime.
+//
+// Each instance normally has a squashfuse mount of its own, so N copies of an
+// image running at once decompress every file N times, and keep N copies of
+// it in the page cache, since they're distinct inodes. With
+// NIX_APPIMAGE_SHARE_MOUNT=1, run-cache.c calls this before the upstream
+// main() instead. The first instance starts a mount that can outlive it, and
+// registers it in $XDG_RUNTIME_DIR/nix-appimage/mounts/<hash>, named with the
+// same key as the run cache; the others start AppRun from there.
+//
+// Every instance holds a shared flock on the mount's .ref file, which is
+// inherited by AppRun and the app. A watcher process waits for an exclusive
+// lock on it, which it only gets once the last of them has exited, and then
+// unregisters the mount and unmounts it. The registry only changes under
+// <hash>.lock.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// run-cache.c
+void exec_apprun(const char *appdir, const char *image, char **argv);
+
+struct registry {
+  char entry[PATH_MAX]; // "<token> <mountpoint>", token naming the .ref file
+  char lock[PATH_MAX];
+  char dir[PATH_MAX - 64]; // leaving room for the file names in it
+  char key[17];
+};
+
+static int registry_init(struct registry *reg, const char *key) {
+  const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+  if (!runtime_dir || runtime_dir[0] != '/') {
+    return -1;
+  }
+  snprintf(reg->key, sizeof(reg->key), "%s", key);
+  snprintf(reg->dir, sizeof(reg->dir), "%s/nix-appimage", runtime_dir);
+  mkdir(reg->dir, 0700);
+  if (snprintf(reg->dir, sizeof(reg->dir), "%s/nix-appimage/mounts",
+               runtime_dir) >= (int)sizeof(reg->dir) ||
+      (mkdir(reg->dir, 0700) < 0 && errno != EEXIST)) {
+    return -1;
+  }
+  if (snprintf(reg->entry, sizeof(reg->entry), "%s/%s", reg->dir, key) >=
+          (int)sizeof(reg->entry) ||
+      snprintf(reg->lock, sizeof(reg->lock), "%s/%s.lock", reg->dir, key) >=
+          (int)sizeof(reg->lock)) {
+    return -1;
+  }
+  return 0;
+}
+
+static int registry_lock(const struct registry *reg) {
+  int fd = open(reg->lock, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    return -1;
+  }
+  while (flock(fd, LOCK_EX) < 0) {
+    if (errno != EINTR) {
+      close(fd);
+      return -1;
+    }
+  }
+  return fd;
+}
+
+static void ref_path(const struct registry *reg, long token, char *buf,
+                     size_t size) {
+  snprintf(buf, size, "%s/%s.%ld.ref", reg->dir, reg->key, token);
+}
+
+// returns the registered mount's token, or -1 if there's none
+static long read_entry(const struct registry *reg, char *mountpoint,
+                       size_t size) {
+  FILE *file = fopen(reg->entry, "re");
+  if (!file) {
+    return -1;
+  }
+  long token = -1;
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t len = getline(&line, &linecap, file);
+  fclose(file);
+  char *space = len > 0 ? strchr(line, ' ') : NULL;
+  if (space && line[len - 1] == '\n' && (size_t)len < size) {
+    line[len - 1] = 0;
+    strcpy(mountpoint, space + 1);
+    token = strtol(line, NULL, 10);
+  }
+  free(line);
+  return token;
+}
+
+// take a reference on the registered mount, returning the locked .ref fd
+static int join_mount(const struct registry *reg, char *mountpoint,
+                      size_t size) {
+  long token = read_entry(reg, mountpoint, size);
+  if (token < 0) {
+    return -1;
+  }
+
+  char ref[PATH_MAX];
+  ref_path(reg, token, ref, sizeof(ref));
+  // not close-on-exec, so that AppRun and the app keep the reference
+  int fd = open(ref, O_RDONLY);
+  if (fd < 0 || flock(fd, LOCK_SH | LOCK_NB) < 0) {
+    // its watcher is taking it down
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+
+  char apprun[PATH_MAX];
+  if (snprintf(apprun, sizeof(apprun), "%s/AppRun", mountpoint) >=
+          (int)sizeof(apprun) ||
+      access(apprun, X_OK) < 0) {
+    // the mount died under its watcher, which cleans up after its users
+    close(fd);
+    unlink(reg->entry);
+    return -1;
+  }
+  return fd;
+}
+
+// the watcher: serve the mount with the image's own runtime until the last
+// reference is gone, reporting the mount point on `ready`
+static void watch_mount(const struct registry *reg, const char *image,
+                        long token, int ready) {
+  setsid();
+  if (chdir("/") < 0) {
+    _exit(1);
+  }
+  int null = open("/dev/null", O_RDWR | O_CLOEXEC);
+  if (null >= 0) {
+    dup2(null, STDIN_FILENO);
+    dup2(null, STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+  }
+
+  int out[2];
+  if (pipe2(out, O_CLOEXEC) < 0) {
+    _exit(1);
+  }
+  pid_t watcher = getpid();
+  pid_t server = fork();
+  if (server < 0) {
+    _exit(1);
+  }
+  if (server == 0) {
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != watcher) {
+      _exit(1);
+    }
+    dup2(out[1], STDOUT_FILENO);
+    execl(image, image, "--appimage-mount", (char *)NULL);
+    _exit(127);
+  }
+  close(out[1]);
+
+  // the runtime prints the mount point once it's mounted
+  char mountpoint[PATH_MAX];
+  FILE *from_server = fdopen(out[0], "r");
+  if (!from_server || !fgets(mountpoint, sizeof(mountpoint), from_server)) {
+    _exit(1);
+  }
+  fclose(from_server);
+  if (write(ready, mountpoint, strlen(mountpoint)) < 0) {
+    _exit(1);
+  }
+  close(ready);
+
+  char ref[PATH_MAX];
+  ref_path(reg, token, ref, sizeof(ref));
+  int fd = open(ref, O_RDONLY | O_CLOEXEC);
+  while (fd >= 0 && flock(fd, LOCK_EX) < 0 && errno == EINTR) {
+  }
+
+  // the last user is gone; a new instance may have registered a mount of
+  // its own while we waited for the registry, so only remove ours
+  int lock = registry_lock(reg);
+  char registered[PATH_MAX];
+  if (read_entry(reg, registered, sizeof(registered)) == token) {
+    unlink(reg->entry);
+  }
+  unlink(ref);
+  if (lock >= 0) {
+    close(lock);
+  }
+
+  kill(server, SIGTERM);
+  waitpid(server, NULL, 0);
+  _exit(0);
+}
+
+// start a shared mount and register it, returning a reference to it
+static int start_mount(const struct registry *reg, int lock,
+                       const char *image, char *mountpoint, size_t size) {
+  // our pid tells this mount apart from others of the same image over time
+  long token = getpid();
+  char ref[PATH_MAX];
+  ref_path(reg, token, ref, sizeof(ref));
+  int fd = open(ref, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0 || flock(fd, LOCK_SH) < 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+
+  int ready[2];
+  if (pipe2(ready, O_CLOEXEC) < 0) {
+    close(fd);
+    return -1;
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    // fork again so the watcher is reparented away from the app. It mustn't
+    // keep our locks either, they're released when we close them.
+    close(fd);
+    close(lock);
+    close(ready[0]);
+    if (fork() == 0) {
+      watch_mount(reg, image, token, ready[1]);
+    }
+    _exit(0);
+  }
+  close(ready[1]);
+  if (pid > 0) {
+    waitpid(pid, NULL, 0);
+  }
+
+  ssize_t len = pid > 0 ? read(ready[0], mountpoint, size - 1) : -1;
+  close(ready[0]);
+  if (len <= 1 || mountpoint[len - 1] != '\n') {
+    close(fd);
+    unlink(ref);
+    return -1;
+  }
+  mountpoint[len - 1] = 0;
+
+  // if this fails, the mount still works for us, it's just not shared
+  char tmp[PATH_MAX];
+  if (snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", reg->entry, token) >=
+      (int)sizeof(tmp)) {
+    return fd;
+  }
+  FILE *file = fopen(tmp, "we");
+  bool ok = file && fprintf(file, "%ld %s\n", token, mountpoint) >= 0;
+  if (file && fclose(file) != 0) {
+    ok = false;
+  }
+  if (!ok || rename(tmp, reg->entry) < 0) {
+    unlink(tmp);
+  }
+  return fd;
+}
+
+// execs AppRun from a shared mount of the image, or returns if that fails
+void shared_mount_exec(const char *image, const char *key, char **argv) {
+  struct registry reg;
+  if (registry_init(&reg, key) != 0) {
+    return;
+  }
+  int lock = registry_lock(&reg);
+  if (lock < 0) {
+    return;
+  }
+
+  char mountpoint[PATH_MAX];
+  int ref = join_mount(&reg, mountpoint, sizeof(mountpoint));
+  if (ref < 0) {
+    ref = start_mount(&reg, lock, image, mountpoint, sizeof(mountpoint));
+  }
+  close(lock);
+  if (ref < 0) {
+    return;
+  }
+
+  exec_apprun(mountpoint, image, argv);
+  // dropping the reference lets the watcher take the mount down again
+  close(ref);
+}
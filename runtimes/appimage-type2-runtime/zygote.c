@@ -0,0 +1,144 @@
+// Client side of AppRun's zygote, for the type2 runtime.
+//
+// run-cache.c calls this before the upstream main() with
+// NIX_APPIMAGE_ZYGOTE=1. If a daemon for this image is listening on
+// $XDG_RUNTIME_DIR/nix-appimage/zygote-<hash>, it sends us its mount of the
+// image along with fds for the namespaces and root it set up, and the host
+// libraries it found, and we start AppRun from that mount with the fds in
+// NIX_APPIMAGE_ZYGOTE_FDS and the libraries in NIX_APPIMAGE_ZYGOTE_LIBS,
+// skipping both the FUSE mount and AppRun's own setup. Otherwise NIX_APPIMAGE_ZYGOTE_SOCKET
+// asks AppRun to start a daemon there for next time. See the Zygote section of
+// appruns/userns-chroot/main.c for the other side.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// run-cache.c
+void exec_apprun(const char *appdir, const char *image, char **argv);
+
+// the daemon's mount point and host libraries, see ZYGOTE_MAX_LIBS in main.c
+#define ZYGOTE_MESSAGE_MAX (PATH_MAX + 64 * 1024)
+
+static int zygote_socket_path(const char *key, struct sockaddr_un *addr) {
+  const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+  if (!runtime_dir || runtime_dir[0] != '/') {
+    return -1;
+  }
+  char dir[sizeof(addr->sun_path)];
+  if (snprintf(dir, sizeof(dir), "%s/nix-appimage", runtime_dir) >=
+      (int)sizeof(dir)) {
+    return -1;
+  }
+  if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+    return -1;
+  }
+
+  addr->sun_family = AF_UNIX;
+  if (snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/zygote-%s", dir,
+               key) >= (int)sizeof(addr->sun_path)) {
+    return -1;
+  }
+  return 0;
+}
+
+// whether `message` holds both of its NUL-terminated strings
+static bool message_complete(const char *message, size_t len) {
+  const char *end = memchr(message, 0, len);
+  return end && memchr(end + 1, 0, len - (end + 1 - message));
+}
+
+// Receive the daemon's "<mount point>\0<libraries>\0" and fds, returning the
+// number of fds. The fds come with the first part of the message, the rest
+// may take more reads.
+static int zygote_receive(int conn, char *message, size_t size, int fds[3]) {
+  struct iovec iov = {.iov_base = message, .iov_len = size};
+  char control[CMSG_SPACE(3 * sizeof(int))];
+  struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control,
+      .msg_controllen = sizeof(control),
+  };
+  ssize_t len = recvmsg(conn, &msg, 0);
+  if (len <= 0) {
+    return -1;
+  }
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+      cmsg->cmsg_type != SCM_RIGHTS) {
+    return -1;
+  }
+  int nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+  memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+
+  size_t done = len;
+  while (!message_complete(message, done)) {
+    ssize_t n = done < size ? read(conn, message + done, size - done) : 0;
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      done = 0;
+      break;
+    }
+    done += n;
+  }
+  if (done == 0 || (msg.msg_flags & MSG_CTRUNC) || nfds < 2 ||
+      message[0] != '/') {
+    for (int i = 0; i < nfds; i++) {
+      close(fds[i]);
+    }
+    return -1;
+  }
+  return nfds;
+}
+
+// execs AppRun from the daemon's mount, or returns if there's no daemon
+void zygote_exec(const char *image, const char *key, char **argv) {
+  struct sockaddr_un addr = {0};
+  if (zygote_socket_path(key, &addr) != 0) {
+    return;
+  }
+
+  // the connection isn't close-on-exec, since it's what tells the daemon
+  // that the app is still running
+  int conn = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (conn < 0) {
+    return;
+  }
+  static char message[ZYGOTE_MESSAGE_MAX];
+  int fds[3] = {-1, -1, -1};
+  if (connect(conn, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      zygote_receive(conn, message, sizeof(message), fds) < 0) {
+    close(conn);
+    setenv("NIX_APPIMAGE_ZYGOTE_SOCKET", addr.sun_path, 1);
+    return;
+  }
+
+  char env[64];
+  snprintf(env, sizeof(env), "%d,%d,%d", fds[0], fds[1], fds[2]);
+  setenv("NIX_APPIMAGE_ZYGOTE_FDS", env, 1);
+  const char *mountpoint = message;
+  setenv("NIX_APPIMAGE_ZYGOTE_LIBS", mountpoint + strlen(mountpoint) + 1, 1);
+
+  exec_apprun(mountpoint, image, argv);
+
+  for (int i = 0; i < 3; i++) {
+    if (fds[i] >= 0) {
+      close(fds[i]);
+    }
+  }
+  close(conn);
+  unsetenv("NIX_APPIMAGE_ZYGOTE_FDS");
+  unsetenv("NIX_APPIMAGE_ZYGOTE_LIBS");
+}
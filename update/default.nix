@@ -0,0 +1,11 @@
+{ writeShellApplication
+, binutils-unwrapped
+, coreutils
+, zsync
+}:
+
+writeShellApplication {
+  name = "update";
+  runtimeInputs = [ binutils-unwrapped coreutils zsync ];
+  text = builtins.readFile ./update.sh;
+}
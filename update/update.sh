@@ -0,0 +1,82 @@
+# shellcheck shell=bash
+# Delta updater for nix-appimage images.
+#
+# Reads the update information that mkAppImage's `updateInformation` embedded
+# in the image's .upd_info section, and uses zsync to download only the blocks
+# of the new image that the old one doesn't already have.
+
+usage() {
+	cat <<USAGE
+Usage: update [OPTIONS] IMAGE
+
+Updates IMAGE in place to the latest version published at the URL in its
+update information.
+
+Options:
+  -o, --output FILE    write the new image to FILE instead of replacing IMAGE
+  -u, --url URL        use this .zsync URL instead of the embedded one
+  -n, --dry-run        only print the update information
+
+Only "zsync|<url>" update information is supported, and zsync only speaks
+plain HTTP.
+USAGE
+}
+
+output=
+url=
+dry_run=
+
+while [ $# -gt 0 ]; do
+	case "$1" in
+	-o | --output) output=$2; shift 2 ;;
+	-u | --url) url=$2; shift 2 ;;
+	-n | --dry-run) dry_run=1; shift ;;
+	-h | --help) usage; exit 0 ;;
+	--) shift; break ;;
+	-*) usage >&2; exit 2 ;;
+	*) break ;;
+	esac
+done
+if [ $# -ne 1 ]; then
+	usage >&2
+	exit 2
+fi
+image=$(realpath "$1")
+output=${output:-$image}
+
+# the section's file offset and size, in hex
+read -r offset size < <(readelf -S -W "$image" |
+	sed -nE 's/.*\.upd_info +[A-Z_]+ +[0-9a-f]+ +([0-9a-f]+) +([0-9a-f]+).*/\1 \2/p') || true
+if [ -z "${offset:-}" ]; then
+	echo "$image has no .upd_info section" >&2
+	exit 1
+fi
+info=$(dd if="$image" bs=1 skip=$((16#$offset)) count=$((16#$size)) status=none | tr -d '\0')
+
+if [ -z "$url" ]; then
+	case "$info" in
+	zsync\|*) url=${info#zsync|} ;;
+	"")
+		echo "$image has no update information" >&2
+		exit 1
+		;;
+	*)
+		echo "unsupported update information: $info" >&2
+		exit 1
+		;;
+	esac
+fi
+
+if [ -n "$dry_run" ]; then
+	echo "$info"
+	exit 0
+fi
+
+workdir=$(mktemp -d "$(dirname "$output")/.update.XXXXXX")
+trap 'rm -rf "$workdir"' EXIT
+
+# blocks the old image already has are copied from it, the rest downloaded
+(cd "$workdir" && zsync -q -i "$image" -o new "$url")
+chmod --reference="$image" "$workdir/new"
+mv "$workdir/new" "$output"
+echo "updated $output" >&2
@@ -0,0 +1,29 @@
+# Workaround for writeClosure bug.
+#
+# Due to a bug in Nix, writeClosure with a path *under* a nix store path (e.g.
+# /nix/store/...-hello/bin/hello) raises the error "path '$program' is not in
+# the Nix store".
+#
+# See: https://github.com/ralismark/nix-appimage/issues/16
+# See: https://github.com/NixOS/nixpkgs/issues/316652
+# See: https://github.com/NixOS/nix/pull/10549
+#
+# This should be fixed in the latest version of Nix, however version where
+# this bug is present are still common, so we work around it by using the old
+# implementation of writeReferencesToFile from
+# https://github.com/NixOS/nixpkgs/blob/e99021ff754a204e38df619ac908ac92885636a4/pkgs/build-support/trivial-builders/default.nix#L628-L640
+{ runCommand }:
+
+path: runCommand "runtime-deps"
+  {
+    exportReferencesGraph = [ "graph" path ];
+  }
+  ''
+    touch $out
+    while read path; do
+      echo $path >> $out
+      read dummy
+      read nrRefs
+      for ((i = 0; i < nrRefs; i++)); do read ref; done
+    done < graph
+  ''